@@ -1,43 +1,325 @@
+// The packet raycaster is compiled a second time for wider SIMD by this file including
+// itself, everything else is left out then (see PACKET_DISPATCH).
+#ifndef PACKET_PASS
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
 #include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <unistd.h>
 #include <termios.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 // === CONFIGURATION ===
 
 // Screen dimensions and visual settings
-#define MAP_WIDTH 16
-#define MAP_HEIGHT 16
-#define SCREEN_WIDTH  90
-#define SCREEN_HEIGHT 50
-
-// Colors
-#define RED_1 "\033[48;2;255;50;50m"
-#define RED_2 "\033[48;2;200;30;30m"
-#define RED_3 "\033[48;2;150;20;20m"
-#define RED_4 "\033[48;2;100;10;10m"
-#define RED_5 "\033[48;2;60;5;5m"
-#define SKY_BG "\033[48;2;135;206;250m"
-#define FLOOR_BG "\033[48;2;50;50;50m"
+// The resolution follows the terminal size (one pixel is PIXEL_CHAR wide),
+// this one is only used when the size can't be queried.
+#define DEFAULT_WIDTH  90
+#define DEFAULT_HEIGHT 50
+// Limits that keep cursor moves within CURSOR_ESC_MAX.
+#define MAX_WIDTH  4096
+#define MAX_HEIGHT 4096
+
+// Colors, as r, g, b. Their escape sequences are built once in palette_build().
+#define RED_1 255, 50, 50
+#define RED_2 200, 30, 30
+#define RED_3 150, 20, 20
+#define RED_4 100, 10, 10
+#define RED_5 60, 5, 5
+#define SKY_BG 135, 206, 250
+#define FLOOR_BG 50, 50, 50
+// Floor and ceiling tiles with --floor, each with a darker grout line.
+#define FLOOR_TILE 110, 100, 80
+#define CEILING_TILE 90, 90, 110
+#define TILE_GROUT 0.6f
 #define RESET "\033[0m"
 
-#define WALL_COLOR "\033[48;2;80;80;80m"
-#define FLOOR_COLOR "\033[48;2;30;30;30m"
-#define PLAYER_COLOR "\033[48;2;255;0;0m"
+// Output backends : how palette colors are encoded. Truecolor escapes are the exact color,
+// xterm-256 ones about half as long, ANSI-16 ones the shortest but only 16 colors.
+enum { COLORS_TRUE, COLORS_256, COLORS_16 };
+
+// Palette indices, cells and wall columns hold these instead of escape sequences.
+// Wall shades follow PAL_WALL, the closest first.
+#define PAL_SKY   0
+#define PAL_FLOOR 1
+#define PAL_MM_WALL   2
+#define PAL_MM_FLOOR  3
+#define PAL_MM_BORDER 4
+#define PAL_MM_PLAYER 5		// One per marker direction : up, down, left, right
+#define PAL_SPRITE 9		// SPRITE_TONES per sprite kind
+#define PAL_WALL  13
+// Wall shades : the 5 RED_* by default, or a gradient across them with --shades N.
+#define SHADE_LEVELS 5
+#define SHADE_LEVELS_MAX 64
+// The gradient reaches the darkest shade at this distance.
+#define SHADE_FAR 8.0f
+// Distance to shade lookup, perpWallDist is quantized to 1 / SHADE_LUT_STEPS of a cell.
+// The RED_* thresholds fall on whole steps, so the lookup matches them exactly.
+// Anything past the end of the table gets the farthest shade.
+#define SHADE_LUT_STEPS 16
+#define SHADE_LUT_SIZE (SHADE_LUT_STEPS * 16)
+// Wall texture (--textures) : TEX_SIZE texels square, each texel one of TEX_TONES tones,
+// the mortar tone being the wall shade darkened by TEX_MORTAR.
+// Every shade gets its own copy with its own palette entries, right after the wall shades.
+#define TEX_SIZE 16
+#define TEX_TONES 2
+#define TEX_MORTAR 0.55f
+// Floor and ceiling casting (--floor) : one TEX_SIZE texture per cell, fogged by distance
+// with the wall shades, in up to FOG_LEVELS_MAX levels.
+// Their palette entries follow the wall textures' : per fog level, floor then ceiling,
+// tile then grout.
+#define FOG_LEVELS_MAX SHADE_LEVELS_MAX
+// Texture coordinates are walked in 16.16 fixed point, TEX_SHIFT turns them into texels.
+#define TEX_SHIFT (16 - 4)
+// Sprites : billboards standing on the floor, the map's objects and, in server mode,
+// the other players. Each kind is a SPRITE_SIZE texels square shape of SPRITE_TONES tones
+// (see sprite_shapes), the second one darkened by SPRITE_SHADOW.
+enum { SPRITE_OBJECT, SPRITE_PEER, SPRITE_KINDS };
+#define SPRITE_SIZE 8
+#define SPRITE_TONES 2
+#define SPRITE_SHADOW 0.6f
+#define OBJECT_COLOR 160, 110, 50
+#define PEER_COLOR 60, 180, 80
+// At most SPRITE_MAX sprites are drawn in a frame, the closest ones,
+// and none closer than SPRITE_NEAR to the camera plane.
+#define SPRITE_MAX 64
+#define SPRITE_NEAR 0.2f
+// Objects are bucketed in a grid of cells SPRITE_GRID_SIZE map cells square, for culling.
+#define SPRITE_GRID_SHIFT 4
+#define SPRITE_GRID_SIZE (1 << SPRITE_GRID_SHIFT)
+
 #define PIXEL_CHAR "  "
 //ALTERNATE PIXEL_CHAR : ░ ▒, ▓,
 
-// mm chars (futur implementation)
+// Minimap (--minimap) colors, a window of up to MINIMAP_SIZE cells square
+// in the top left corner, each map cell one terminal cell.
+#define WALL_COLOR 80, 80, 80
+#define FLOOR_COLOR 30, 30, 30
+#define PLAYER_COLOR 255, 0, 0
+#define BORDER_COLOR 0, 0, 0
+#define MINIMAP_SIZE 20
+
+// mm chars : the player marker, pointing where the player looks, in PLAYER_COLOR on FLOOR_COLOR.
+// They are as wide as PIXEL_CHAR, and so is the border.
+// DIR_CHAR_UP is also the pixel of --half-block, two pixels stacked in one cell.
 #define DIR_CHAR_UP "▀▀"
 #define DIR_CHAR_DOWN  "▄▄"
 #define DIR_CHAR_LEFT "█ "
 #define DIR_CHAR_RIGHT " █"
-#define BORDER_COLOR "\033[48;2;0;0;0m"
-#define BORDER_CHAR  "  "
+#define BORDER_CHAR  PIXEL_CHAR
+
+// PIXEL_CHAR and DIR_CHAR_UP repeated 16 times, runs of pixels are copied from them.
+#define PIXEL_RUN4 PIXEL_CHAR PIXEL_CHAR PIXEL_CHAR PIXEL_CHAR
+#define PIXEL_RUN PIXEL_RUN4 PIXEL_RUN4 PIXEL_RUN4 PIXEL_RUN4
+#define HALF_RUN4 DIR_CHAR_UP DIR_CHAR_UP DIR_CHAR_UP DIR_CHAR_UP
+#define HALF_RUN HALF_RUN4 HALF_RUN4 HALF_RUN4 HALF_RUN4
+
+#define CLEAR_SEQ "\033[H\033[J"
+#define HIDE_CURSOR "\033[?25l"
+#define SHOW_CURSOR "\033[?25h"
+// Longest color escape we can emit : "\033[48;2;255;255;255m"
+#define COLOR_ESC_MAX 19
+// Longest cursor move we can emit : "\033[9999;9999H"
+#define CURSOR_ESC_MAX 12
+// Worst case frame for a w * h screen with pixels p characters wide : the clear sequence,
+// then for every cell a cursor move, a background and a foreground escape
+// and the pixel (up to 3 bytes a character, for half blocks),
+// a RESET and newline at the end of each row, and the HUD. Binary frames (see WIRE_*) take
+// less than that, but may come after a palette.
+#define FRAME_BUF_SIZE(w, h, p) (sizeof(CLEAR_SEQ) - 1 + (size_t)(h) * ((w) \
+	* (CURSOR_ESC_MAX + 2 * COLOR_ESC_MAX + 3 * (p)) + sizeof(RESET) - 1 + 1) + HUD_MAX \
+	+ WIRE_PALETTE_MAX)
+// In delta mode, unchanged cells between two changed runs are rewritten instead of
+// moving the cursor over them when the gap is at most this many cells.
+#define DELTA_GAP_MERGE 3
+
+// Frame rate cap : input arriving faster than this is coalesced into the next frame.
+#define TARGET_FPS 60
+
+// Benchmark mode : frames rendered by default, and how long each key of the camera path
+// is held. The default path walks, turns both ways, strafes and stands still
+// ('.' is a beat with no key), so both full casts and empty deltas get measured.
+#define BENCH_FRAMES 1000
+#define BENCH_BEAT_MS 250
+#define BENCH_PATH "wwwwwwwweeeeeeeewwwwddddqqqqqqqqqqqqssssaaaa....wwwwqqqq"
+// Frames --verify renders along the camera path with each caster, by default.
+#define VERIFY_FRAMES 300
+// Reference files of --save-ref and --check-ref : the REF_MAGIC header and the resolution
+// (two ints), then each frame's reference columns : draw_start and draw_end (ints),
+// wallColor and texX. A column checked against one may be off by up to REF_TOLERANCE
+// rows, shades or texture columns, in at most REF_OFF_MAX of every thousand columns.
+#define REF_MAGIC "CUBEREF1"
+#define REF_TOLERANCE 1
+#define REF_OFF_MAX 1
+
+// Governor (--governor) : when frames take longer than GOV_SLOW of the frame budget to get
+// out to the terminal, pixels get one PIXEL_CHAR wider (so fewer columns are cast and written),
+// up to GOV_MAX_SCALE, then the frame rate is halved down to GOV_MIN_FPS.
+// Once frames take less than GOV_FAST of the budget for GOV_CALM frames in a row,
+// it goes back up one step at a time. Frames right after a change aren't measured.
+#define GOV_MAX_SCALE 4
+#define GOV_MIN_FPS 8
+#define GOV_SLOW 0.75
+#define GOV_FAST 0.25
+#define GOV_CALM 30
+#define GOV_SETTLE 5
+
+// Server mode (--serve) : most clients served at once, and epoll events handled per wait.
+#define SERVE_MAX_CLIENTS 64
+#define SERVE_EVENTS 64
+
+// Binary frame protocol, sent with --binary and decoded to ANSI by --connect.
+// Every message is a type byte and a 32-bit payload length, then the payload.
+// Integers are little-endian, counts of cells are LEB128 varints.
+//	WIRE_PALETTE : a 16-bit count, then per entry its background r, g, b and a glyph
+//	               length, followed by the foreground r, g, b and the glyph if it has one
+//	WIRE_FRAME   : WIRE_* flags, 16-bit width and height in pixels, the pixel width,
+//	               then runs of cells in row-major order : the unchanged cells to skip,
+//	               the length of the run, and the palette index of its cells
+//	WIRE_HUD     : the HUD line, as text
+// Full frames come right after the palette, so a client can start from any of them.
+#define WIRE_PALETTE 'P'
+#define WIRE_FRAME 'F'
+#define WIRE_HUD 'H'
+#define WIRE_FULL 1
+#define WIRE_HALF 2
+#define WIRE_HEADER 5
+#define WIRE_FRAME_HEADER (WIRE_HEADER + 6)
+#define WIRE_GLYPH_MAX 8
+#define WIRE_PALETTE_MAX (WIRE_HEADER + 2 + 256 * (7 + WIRE_GLYPH_MAX))
+// Largest message a client accepts, a frame of MAX_WIDTH * MAX_HEIGHT runs.
+#define WIRE_MSG_MAX ((size_t)MAX_WIDTH * MAX_HEIGHT * 9 + WIRE_FRAME_HEADER)
+
+// Packet raycasting : adjacent columns are cast together, one per SIMD lane,
+// using GCC/clang vector extensions so the same code compiles to SSE, AVX or NEON.
+// 8 lanes when AVX is available, 4 otherwise. x86-64 builds without AVX (the portable ones)
+// also get an 8 lane AVX2 version, picked at startup when the CPU has it, unless built
+// with -DNO_PACKET_DISPATCH. Build with -DNO_RAY_PACKET to keep only the scalar path,
+// it is also used at runtime with --scalar and for leftover columns.
+#if defined(__GNUC__) && !defined(NO_RAY_PACKET) && !defined(FIXED_DDA)
+# define RAY_PACKET 1
+# if defined(__AVX__)
+#  define PACKET_WIDTH 8
+# else
+#  define PACKET_WIDTH 4
+#  if defined(__x86_64__) && !defined(__clang__) && !defined(NO_PACKET_DISPATCH)
+#   define PACKET_DISPATCH 1
+#  endif
+# endif
+#endif
+
+// Fixed-point DDA, for targets without fast floating point : build with -DFIXED_DDA to cast
+// rays with integers only. Ray directions and distances are then fixed point with FIX_BITS
+// fractional bits in 64-bit integers, and 1 / rayDir comes from a table of RECIP_BITS bits
+// refined by two Newton steps instead of a division. 22 bits is the least for which the
+// default view casts the same wall slices as floats, with 16 a pixel is off now and then.
+// Packets are float only, such builds cast every ray through the scalar path.
+// deltaDist is capped to FIX_INF, small enough that a cell's fraction times it still fits
+// in 64 bits : rays parallel to an axis get it, like the float path's 1e30.
+#ifdef FIXED_DDA
+# define FIX_BITS 22
+# define FIX_ONE (1LL << FIX_BITS)
+# define FIX_INF (1LL << (62 - FIX_BITS))
+# define RECIP_BITS 8
+// perpWallDist comes out a little long, by up to about 2^-21 of it : walls exactly a whole
+// number of rows tall, which poses on a cell's middle see often, would get a row less than
+// with floats. Slice heights are taken for a distance shorter by 2^-FIX_SLACK of it,
+// which only moves heights that much under a whole number of rows.
+# define FIX_SLACK 19
+typedef long long	t_dist;
+# define DIST_MAX LLONG_MAX
+#else
+typedef float		t_dist;
+# define DIST_MAX INFINITY
+#endif
+
+// Frame statistics for the --hud line and the --stats stream. The counters cost a few
+// increments per ray and per escape, build with -DNO_STATS to compile them out entirely.
+#ifndef NO_STATS
+# define STATS 1
+# define STAT(x) x
+#else
+# define STAT(x)
+#endif
+// Room for the HUD line at the end of the frame buffer.
+#define HUD_MAX 200
+
+// Columns are cast by worker threads in tiles of this many columns (with --threads).
+// A multiple of 16 so a tile of int column buffers spans whole 64-byte cache lines,
+// and two workers never write to the same line.
+#define TILE_COLUMNS 64
+#define CACHE_LINE 64
+
+// Movement speeds, per second a key is held.
+#define MOVE_SPEED 3.0	// cells per second
+#define ROT_SPEED  1.5	// radians per second
+// Terminals only send key presses, and repeat them while the key stays down.
+// A key counts as released when no repeat arrived for this long,
+// it has to be longer than the terminal's key-repeat interval (usually 30-40 ms).
+#define KEY_RELEASE_MS 70
 
-// Map of the scene, each Char or block/tile is described as a "cell" in subsequent comments.
-char *map[] = 
+// Input recordings : the REC_MAGIC header, then one record per key byte received,
+// the ms since the previous record as a LEB128 varint followed by the byte itself.
+// Key repeats come every 30-40 ms, so most records take 2 bytes.
+#define REC_MAGIC "CUBEREC1"
+#define REC_MAX 6
+
+// Map cell values, as stored in t_map.
+#define CELL_EMPTY 0
+#define CELL_WALL  1
+#define CELL_OBJECT 2		// An empty cell with an object standing in its middle
+#define CELL_DOOR  3		// A closed door, solid like a wall
+#define CELL_DOOR_OPEN 4
+// The space bar opens or closes the door in front of the player, up to this far.
+#define DOOR_REACH 1.0f
+
+// Empty-space skipping : the map is also divided in blocks of BLOCK_SIZE * BLOCK_SIZE cells,
+// and the DDA crosses blocks without any wall in one jump.
+#define BLOCK_SHIFT 3
+#define BLOCK_SIZE (1 << BLOCK_SHIFT)
+// The cell a column hit last frame is only tried first when the ray crosses at least
+// COHERENCE_RUN cells per row (or column) of the map and reaches at least COHERENCE_MIN
+// cells along it, shorter rays being cheap to cast anyway (see coherent_hit()).
+#define COHERENCE_RUN 3
+#define COHERENCE_MIN 8
+// --turn-reuse : while only turning, a column reuses the wall its ray hit last frame
+// when some column of the last frame pointed within this many columns of it.
+#define TURN_REUSE_TOLERANCE 0.25f
+
+// Binary map files start with this magic, see map_load_binary().
+#define MAP_MAGIC "CUBEMAP1"
+#define MAP_HEADER_SIZE 24
+// Prebuilt maps, written by --save-map : the cells, acceleration structures and objects,
+// each starting on a MAP_ALIGN boundary, see map_load_prebuilt().
+#define MAP_MAGIC_PREBUILT "CUBEMAP2"
+#define MAP_ALIGN 4096
+// Prebuilt maps are read in around the player in chunks of CHUNK_SIZE cells square, see
+// map_prefetch(). Rays stop after VIEW_RADIUS_MAPPED cells on them without --view-radius.
+#define CHUNK_SHIFT 6
+#define CHUNK_SIZE (1 << CHUNK_SHIFT)
+#define VIEW_RADIUS_MAPPED 128
+
+// Default map of the scene, used when no map file is given.
+// Each Char or block/tile is described as a "cell" in subsequent comments.
+// '1' is a wall, '0' or ' ' is empty, 'o' an object, 'D' a door, and 'P' is where the player starts.
+char *default_map[] =
 {
 	"1111111111111111",
 	"1100000000000001",
@@ -55,8 +337,37 @@ char *map[] =
 	"1011001000000001",
 	"100110000P000001",
 	"1111111111111111",
+	NULL
 };
 
+// The loaded map, as one contiguous row-major grid of cells.
+// It is surrounded by a border of walls, so a ray always hits something
+// before leaving the grid, and the DDA never has to check bounds.
+typedef struct {
+	int		width;		// Including the border
+	int		height;
+	uint8_t	*cells;		// width * height cell values
+	float	spawnX;		// Where the player starts
+	float	spawnY;
+	void	*mapped;	// The file mapping when loaded from a binary map, else NULL
+	size_t	mapped_size;
+	int		prebuilt;	// The acceleration structures and objects are mapped too
+
+	// Acceleration structures, built from cells by map_build_accel().
+	uint64_t	*solid;			// One bit per cell, 1 for walls, rows of solid_stride words
+	int			solid_stride;
+	uint64_t	*solid_t;		// The same bits transposed, columns of solid_t_stride words
+	int			solid_t_stride;
+	uint8_t		*blocks;		// Number of walls in each block, rows of blocks_stride
+	int			blocks_stride;
+} t_map;
+
+t_map	map;
+
+// Rays stop this far from the camera (--view-radius), as if they hit a wall,
+// so that a huge mapped map is only ever read around the player.
+t_dist	dda_limit = DIST_MAX;
+
 // The player's state in the world,
 // position, direction, and field of view (FOV) projection plane.
 typedef struct {
@@ -119,22 +430,22 @@ typedef struct {
 // Represents a single ray cast from the player's position,
 // used to calculate wall collisions and rendering information for one vertical column.
 typedef struct {
-	float cameraX;		// X-coordinate in camera space:
+	t_dist cameraX;		// X-coordinate in camera space:
 						// Ranges from -1 (left side of screen) to +1 (right side).
 						// Used to interpolate between the left/right extremes of the FOV.
 
-	float rayDirX;		// Direction of the ray (X axis)
-	float rayDirY;		// Direction of the ray (Y axis)
+	t_dist rayDirX;		// Direction of the ray (X axis)
+	t_dist rayDirY;		// Direction of the ray (Y axis)
 						// This is calculated by combining the player's direction
 						// with the camera plane scaled by cameraX.
 
 	int mapX;			// Current cell the ray is in on the X axis
 	int mapY;			// Current cell the ray is in on the Y axis
 
-	float deltaDistX;	// Distance the ray travels between successive vertical gridlines.
+	t_dist deltaDistX;	// Distance the ray travels between successive vertical gridlines.
 						// Computed as: deltaDistX = abs(1 / rayDirX)
 						// It represents how far the ray must move to go from one x-side to the next.
-	float deltaDistY;	// deltaDistY Same but for horizontal gridlines (y-axis)
+	t_dist deltaDistY;	// deltaDistY Same but for horizontal gridlines (y-axis)
 
 	/*
 		deltaDistX and deltaDistY are constant for each rays.
@@ -190,9 +501,23 @@ typedef struct {
 		deciding whether the ray hits the next vertical or horizontal gridline first.
 	*/
 
-	float sideDistX;	// Distance the ray has to travel from its starting position
+	t_dist sideDistX;	// Distance the ray has to travel from its starting position
 						// to the next x-side (vertical grid line)
-	float sideDistY;	// sideDistY Same as above but for y-side (horizontal grid line)
+	t_dist sideDistY;	// sideDistY Same as above but for y-side (horizontal grid line)
+
+	t_dist startDistX;	// sideDistX/Y before the first step
+	t_dist startDistY;
+	int stepsX;			// Steps taken so far along X/Y
+	int stepsY;
+
+	/*
+		Instead of adding deltaDistX to sideDistX at every step, sideDistX is always computed
+		as startDistX + stepsX * deltaDistX (see dda_dist()). Both are the same distance,
+		but this one only depends on how many steps were taken, not on the order of
+		rounding errors along the way. The DDA can then jump over many cells at once
+		(see skip_block()) and still land on exactly the same value as if it had stepped
+		cell by cell.
+	*/
 
 	int stepX;			// Direction to step in X (either +1 or -1)
 	int stepY;			// Direction to step in Y (either +1 or -1)
@@ -201,331 +526,5393 @@ typedef struct {
 	int side;			// Whether the wall was hit from the X (0) or Y (1) side.
 						// Used for shading and perspective correction.
 
-	float perpWallDist;	// Corrected perpendicular distance to the wall from the player.
+	t_dist perpWallDist;	// Corrected perpendicular distance to the wall from the player.
 						// This is what ultimatly determines how tall the wall slice is.
 						// Avoids weird rendering effect when ray is not straight-on.
+
+	int dda_steps;		// DDA iterations, for the stats
+#ifdef FIXED_DDA
+	t_dist posX;		// The player's position, where fixed-point rays start
+	t_dist posY;
+#endif
 } t_ray;
 
-// Buffers for each screen column.
-int			draw_start[SCREEN_WIDTH];
-int			draw_end[SCREEN_WIDTH];
-const char	*wallColor[SCREEN_WIDTH];
+// What each column's ray hit in a cast, and the pose it was cast for.
+// The next cast starts from these (see coherent_hit() and --turn-reuse).
+typedef struct {
+	int				*x;			// Wall cell hit
+	int				*y;
+	t_dist			*dist;		// perpWallDist
+	unsigned char	*side;
+	unsigned char	*exact;		// 0 if reused from the cast before instead of cast
+	t_player		pose;
+	int				valid;		// 0 until filled
+} t_hits;
+
+// Buffers for each screen column, along with the resolution they were cast for.
+// Each array starts on a cache line.
+typedef struct {
+	int			width;
+	int			height;
+	int			*draw_start;
+	int			*draw_end;
+	float		*zbuf;			// perpWallDist of each column, sprites behind it are hidden
+	unsigned char	*wallColor;	// Palette index of each column's wall shade
+	unsigned char	*texX;		// Texture column hit by each column's ray, with --textures
+	unsigned int	*texStart;	// Texture row (16.16 fixed point) at draw_start
+	unsigned int	*texStep;	// Texture rows per pixel (16.16 fixed point)
+	t_player		pose;		// Pose the columns were cast for, to cast the floor with
+	t_hits		*prev;		// Hits of the cast before, read while casting
+	t_hits		*next;		// and of this one
+	long long	steps;		// DDA steps of every column of the last cast
+	long long	cached;		// Columns of the last cast that hit the same cell as before
+	long long	reused;		// Columns of the last cast reused while turning
+	long long	cast_ns;	// How long the last cast took
+	long long	frame_ns;	// How long the render() before it took, for the stats
+} t_columns;
+
+// The whole frame is composed in this buffer, then flushed to the terminal with a single write(2).
+// It is sized for the worst case so composing a frame never has to check for room.
+typedef struct {
+	char	*data;
+	size_t	len;
+	int		escapes;	// Escape sequences composed into the frame, for the stats
+} t_frame;
+
+// Everything that depends on the resolution. All buffers are carved out of a single arena,
+// which is only reallocated when the size changes (see screen_resize()),
+// so rendering a frame never allocates.
+typedef struct {
+	int			width;			// Resolution in pixels
+	int			height;
+	int			pixel;			// Characters per pixel, a multiple of PIXEL_CHAR's
+	int			half;			// Pixel rows per terminal row, 2 with --half-block
+	int			rows;			// Terminal rows
+	float		*row_dist;		// With --floor, distance of the floor (or ceiling) seen by each row
+	unsigned char	*row_fog;	// and its fog level
+
+	char		*arena;
+
+	// Double-buffered cell grid : the palette index of every cell for the frame being composed,
+	// and for the frame the terminal is currently showing.
+	// Comparing both tells which cells actually need to be rewritten.
+	unsigned char	*cells[2];
+	int			cur;			// Index of the grid filled for the current frame
+	int			valid;			// 0 until a full frame has been shown, forces a full repaint
+
+	t_frame		frame;
+	// With --output-thread, two more grids and the frame buffer the output thread
+	// composes into, see t_output.
+	unsigned char	*out_cells[2];
+	char		*out_data;
+
+	// Two column sets : with worker threads, a cast for the pose in flight
+	// is running (or done) in columns[back] while columns[!back] is presented.
+	t_columns	columns[2];
+	// Hits of the last two casts, hits[hits_cur] being the latest (see cast_begin()).
+	t_hits		hits[2];
+	int			hits_cur;
+	int			back;
+	int			inflight;
+	int			front_ready;
+	t_player	inflight_pose;
+	// Cells x0, y0, x1, y1 of a prebuilt map last read in for this screen's casts.
+	int			prefetch[4];
+} t_screen;
+
+t_screen	screen;
+// Rendered with the reference caster by --bench and --verify, to check screen's frames against.
+t_screen	reference;
+
+// Keys driving the player, in the order of t_input arrays.
+enum { KEY_FORWARD, KEY_BACKWARD, KEY_LEFT, KEY_RIGHT, KEY_ROT_LEFT, KEY_ROT_RIGHT, KEY_COUNT };
+
+// Input state, built from every byte read from the terminal.
+// Each key is tracked from its first press to KEY_RELEASE_MS after its last repeat,
+// and held[] is how long (in seconds) each key was down during the frame being simulated.
+typedef struct {
+	long long	pressed_at[KEY_COUNT];	// Start of the current press, in ms
+	long long	last_seen[KEY_COUNT];	// Last byte received for this key, in ms
+	float		held[KEY_COUNT];		// Seconds held during the current frame
+	long long	last_use;				// Last space received, in ms
+	int			use;					// Space was pressed since the last frame
+	int			quit;					// ESC was pressed, or stdin closed
+} t_input;
+
+// Key bytes being recorded with --record. Every drain is written out at once with write(2),
+// so the log is complete even if the process dies from a signal.
+typedef struct {
+	int				fd;			// -1 when not recording
+	long long		last;		// Time of the previous record, in ms
+	unsigned char	buf[256 * REC_MAX];
+	size_t			len;
+} t_recorder;
+
+t_recorder	recorder = { .fd = -1 };
+
+// A recording being replayed with --replay, loaded whole.
+typedef struct {
+	unsigned char	*data;
+	size_t			size;
+	size_t			pos;		// Next record
+	long long		at;			// Time of the next record, in ms since the recording started
+	int				done;
+} t_replay;
+
+t_replay	replay;
+
+// Runtime options, set from the command line in parse_args().
+typedef struct {
+	int	full_redraw;	// Repaint every cell each frame instead of only the changed ones
+	int	fps;			// Frame rate cap, frames are only rendered when something changed
+	int	scalar;			// Cast rays one at a time even when packet raycasting is available
+	int	threads;		// Worker threads casting columns, 0 to cast on the main thread
+	int	width;			// Fixed resolution from --size, 0 to follow the terminal
+	int	height;
+	const char	*map_path;	// Map file from --map, NULL for the default map
+	const char	*save_path;	// --save-map : write the map as a prebuilt map file and exit
+	int	gen_width;		// --gen-map : random map size, 0 when not generating
+	int	gen_height;
+	int	no_skip;		// Step the DDA cell by cell, without crossing empty blocks at once
+	int	no_cache;		// Always run the DDA, without checking the cell hit last frame first
+	int	view_radius;	// Cells rays stop after, 0 for no limit
+	int	turn_reuse;		// While turning, reuse last frame's hits of columns pointing close enough
+	int	governor;		// Lower the resolution, then the frame rate, when output can't keep up
+	int	shades;			// Wall shade levels, SHADE_LEVELS for the plain RED_* ones
+	int	colors;			// Output backend, COLORS_*, picked from the environment by default
+	int	half_block;		// Two pixel rows per terminal row, with half-block characters
+	int	textures;		// Textured walls instead of flat shades
+	int	floor;			// Cast textured floor and ceiling instead of flat sky and floor
+	int	minimap;		// Show the map around the player in the top left corner
+	int	bench;			// --bench : frames to render headless along the camera path, 0 to play
+	int	verify;			// --verify : check every caster against the reference one, over bench frames
+	const char	*ref_path;	// --save-ref or --check-ref : reference columns file of --verify
+	int	ref_save;		// 1 to write ref_path, 0 to check the reference caster against it
+	const char	*bench_path;	// Keys of the camera path, one per BENCH_BEAT_MS
+	const char	*record_path;	// --record : log every key byte to this file
+	const char	*replay_path;	// --replay : feed the keys of this log instead of the camera path
+	int	hud;			// Show the frame stats on the line below the frame
+	const char	*stats_path;	// --stats : stream the frame stats as JSON lines to this file
+	const char	*serve;			// --serve : Unix socket path or [HOST]:PORT to serve clients on
+	int	output_thread;	// Compose and write frames on their own thread, see t_output
+	int	binary;			// Send frames in the binary protocol (WIRE_*) instead of ANSI
+	const char	*connect;		// --connect : server to show the binary frames of
+} t_options;
+
+t_options	opts;
+
+// A palette color and the escape sequences selecting it as background and as foreground.
+// Cells of most colors are PIXEL_CHAR on their background. A few (the minimap's player marker)
+// are a glyph instead, in their foreground color on the background of seq.
+typedef struct {
+	unsigned char	rgb[3];
+	unsigned char	len;
+	unsigned char	fg_len;
+	unsigned char	glyph_len;
+	char			seq[COLOR_ESC_MAX + 1];
+	char			fg[COLOR_ESC_MAX + 1];
+	const char		*glyph;		// NULL for PIXEL_CHAR, otherwise as wide as PIXEL_CHAR
+} t_color;
+
+// Every index a cell can hold.
+t_color			palette[256];
+unsigned char	shade_lut[SHADE_LUT_SIZE];
+// Pre-shaded textures, column-major : textures[shade][texX][texY] is a palette index.
+// The door texture follows the brick one, its columns are TEX_SIZE to 2 * TEX_SIZE - 1.
+unsigned char	textures[SHADE_LEVELS_MAX][2 * TEX_SIZE][TEX_SIZE];
+// Fogged floor and ceiling textures, row-major : floor_tex[fog][0 floor, 1 ceiling][texY][texX].
+unsigned char	floor_tex[FOG_LEVELS_MAX][2][TEX_SIZE][TEX_SIZE];
+// Fog level of each wall shade, there may be fewer fog levels than shades to fit the palette.
+unsigned char	shade_fog[SHADE_LEVELS_MAX];
+// Sprite shapes, row-major : sprite_tex[kind][texY][texX] is a palette index, 0 for see-through.
+unsigned char	sprite_tex[SPRITE_KINDS][SPRITE_SIZE][SPRITE_SIZE];
+
+const unsigned char	shade_rgb[SHADE_LEVELS][3] = { {RED_1}, {RED_2}, {RED_3}, {RED_4}, {RED_5} };
+// Distances where each RED_* shade ends.
+const float			shade_dist[SHADE_LEVELS - 1] = { 1.5, 3.0, 5.0, 7.0 };
+
+// Stats of the frames being presented, see stats_frame().
+typedef struct {
+	int			fd;			// --stats stream, -1 when not exporting
+	long long	frames;
+	long long	frame_ns;	// Time spent in the last render()
+	long long	started;	// Start of the render() in progress
+} t_stats;
+
+t_stats	stats = { .fd = -1 };
+
+// Governor state (see GOV_*). drain_ms is a moving average of how long frames take
+// to be written and drained to the terminal.
+typedef struct {
+	int		scale;		// Pixels are scale PIXEL_CHARs wide
+	int		fps;		// Current frame rate cap, up to opts.fps
+	float	drain_ms;
+	int		calm;		// Frames in a row under GOV_FAST
+	int		settle;		// Frames left before measuring again after a change
+	int		changed;	// Set on a change, the main loop then applies it
+} t_governor;
+
+t_governor	governor = { .scale = 1 };
+
+// Output thread (--output-thread) : the main thread only fills cell grids, and hands them
+// to this thread, which composes and writes them out, so a slow terminal never holds up
+// input or casting. Grids go through a lock-free triple buffer, a queue of one frame
+// where a newer frame replaces the one waiting : the main thread owns slots[back],
+// the output thread slots[front], and ready holds the index of the third one,
+// with OUT_FRESH set while it has a frame the output thread hasn't taken yet.
+// Each side swaps its slot with ready in one atomic exchange.
+// Frames are composed against shown, the grid last written out, so dropping frames
+// never leaves the terminal out of date. The view is reset with the screen, the first
+// frame after a resize is then a full repaint.
+// lock is only held while a frame is written, so that screen_resize() can wait for it.
+#define OUT_FRESH 4
+
+typedef struct {
+	unsigned char	*grid;
+	t_columns		cols;		// Stats of the cast the grid comes from
+} t_output_slot;
+
+typedef struct {
+	pthread_t		thread;
+	pthread_mutex_t	lock;
+	sem_t			wake;		// Posted for every frame handed over
+	t_output_slot	slots[3];
+	unsigned		ready;
+	int				back;
+	int				front;
+	unsigned char	*shown;
+	t_screen		view;		// The screen as the output thread composes it
+	long long		dropped;	// Frames replaced before they could be written
+	int				running;
+	int				quit;
+} t_output;
+
+t_output	output;
+
+// The minimap : the window of the map shown on screen, with its border and the player marker.
+// The window is only touched when the marker changes cell or direction : the marker's
+// previous cell is drawn again from the map, or the window entirely if it scrolled.
+// Every frame it is then copied over the corner of the cell grid as it is.
+typedef struct {
+	unsigned char	view[(MINIMAP_SIZE + 2) * (MINIMAP_SIZE + 2)];
+	int				vw;			// Map cells in the window, without the border
+	int				vh;
+	int				ox;			// Map cell at the top left of the window
+	int				oy;
+	int				px;			// Marker cell, -1 until the first frame
+	int				py;
+	int				dir;		// Marker palette index
+} t_minimap;
+
+t_minimap	minimap = { .px = -1 };
+
+// A sprite in the world.
+typedef struct {
+	float		x;
+	float		y;
+	int			kind;
+	const void	*owner;		// For a peer, the screen of its own client, which doesn't draw it
+} t_sprite;
+
+// A sprite in front of the camera, as seen in a frame.
+typedef struct {
+	float	depth;			// Distance to the camera plane, compared with the z-buffer
+	float	screenX;		// Column of its center
+	int		kind;
+} t_sprite_view;
+
+// Every sprite. The map's objects are bucketed in a coarse grid as the map is loaded
+// (or mapped with a prebuilt map), object_grid[b] to object_grid[b + 1] being the objects
+// of bucket b, so a frame only looks at the buckets in view. Peers are set by the server
+// before each frame, and are few enough to all be tried.
+typedef struct {
+	uint32_t	*objects;		// Cell of each object, y << 16 | x
+	int32_t		*object_grid;
+	int			grid_w;
+	int			grid_h;
+	t_sprite	peers[SERVE_MAX_CLIENTS];
+	int			peer_count;
+} t_sprites;
+
+t_sprites	sprites;
 
 // Get appropriate red shade based on distance, closer is brighter.
-const char *get_shade(float dist)
+// Returns its palette index, looked up from the quantized distance.
+unsigned char get_shade(float dist)
 {
-	if (dist < 1.5)
-		return RED_1;
-	if (dist < 3.0)
-		return RED_2;
-	if (dist < 5.0)
-		return RED_3;
-	if (dist < 7.0)
-		return RED_4;
-	return RED_5;
+	if (!(dist < SHADE_LUT_SIZE / (float)SHADE_LUT_STEPS))
+		return (shade_lut[SHADE_LUT_SIZE - 1]);
+	return (shade_lut[(int)(dist * SHADE_LUT_STEPS)]);
 }
 
-// Clears terminal.
-void clear_screen()
+// Monotonic clock in milliseconds.
+long long now_ms(void)
 {
-	printf("\033[H\033[J");
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000LL + ts.tv_nsec / 1000000);
 }
 
-// Initializes all ray parameters for a single screen column.
-// Computes the ray direction based on the camera plane and player view direction.
-// Sets the initial map tile the ray is in, and calculates the fixed distances (deltaDistX/Y)
-// between x/y-side intersections. Handles division-by-zero by using a very large float.
-void init_ray(t_ray *ray, int column, t_player *player)
+// Monotonic clock in nanoseconds, for timings.
+long long now_ns(void)
 {
-	ray->cameraX = 2 * column / (float)SCREEN_WIDTH - 1;
-	ray->rayDirX = player->dirX + player->planeX * ray->cameraX;
-	ray->rayDirY = player->dirY + player->planeY * ray->cameraX;
-	ray->mapX = (int)player->x;
-	ray->mapY = (int)player->y;
-	ray->deltaDistX = 0;
-	ray->deltaDistY = 0;
+	struct timespec	ts;
 
-	if (ray->rayDirX != 0) {
-		ray->deltaDistX = fabs(1 / ray->rayDirX);
-	} else {
-		ray->deltaDistX = 1e30;
-	}
-	if (ray->rayDirY != 0) {
-		ray->deltaDistY = fabs(1 / ray->rayDirY);
-	} else {
-		ray->deltaDistY = 1e30;
-	}
-	ray->hit = 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000LL + ts.tv_nsec);
 }
 
-// Based on the ray's direction, this function determines which direction (+/-) to step
-// along the X and Y axes. Also calculates the initial distance from the player's position
-// to the first X or Y side of the current map square.
-void compute_initial_steps(t_ray *ray, t_player *player)
+// The 16 ANSI colors, as xterm shows them.
+const unsigned char	ansi16_rgb[16][3] = {
+	{0, 0, 0}, {205, 0, 0}, {0, 205, 0}, {205, 205, 0},
+	{0, 0, 238}, {205, 0, 205}, {0, 205, 205}, {229, 229, 229},
+	{127, 127, 127}, {255, 0, 0}, {0, 255, 0}, {255, 255, 0},
+	{92, 92, 255}, {255, 0, 255}, {0, 255, 255}, {255, 255, 255}
+};
+// Levels of each channel in the xterm-256 6x6x6 color cube.
+const unsigned char	cube_levels[6] = {0, 95, 135, 175, 215, 255};
+
+int color_dist(int r, int g, int b, const unsigned char *c)
 {
-	if (ray->rayDirX < 0)
-	{
-		ray->stepX = -1;
-		ray->sideDistX = (player->x - ray->mapX) * ray->deltaDistX;
-	}
-	else
-	{
-		ray->stepX = 1;
-		ray->sideDistX = (ray->mapX + 1.0 - player->x) * ray->deltaDistX;
-	}
-	if (ray->rayDirY < 0)
+	return ((r - c[0]) * (r - c[0]) + (g - c[1]) * (g - c[1]) + (b - c[2]) * (b - c[2]));
+}
+
+// Closest xterm-256 color to r, g, b : the closest cube color, or gray if that is closer.
+int nearest_256(int r, int g, int b)
+{
+	unsigned char	c[3];
+	int				rgb[3];
+	int				cube[3];
+	int				gray;
+	int				i;
+	int				k;
+
+	rgb[0] = r;
+	rgb[1] = g;
+	rgb[2] = b;
+	i = 0;
+	while (i < 3)
 	{
-		ray->stepY = -1;
-		ray->sideDistY = (player->y - ray->mapY) * ray->deltaDistY;
+		k = 0;
+		while (k < 5 && abs(rgb[i] - cube_levels[k + 1]) <= abs(rgb[i] - cube_levels[k]))
+			k++;
+		cube[i] = k;
+		c[i++] = cube_levels[k];
 	}
-	else
+	k = color_dist(r, g, b, c);
+	gray = ((r + g + b) / 3 - 8 + 5) / 10;
+	gray = gray < 0 ? 0 : gray > 23 ? 23 : gray;
+	c[0] = 8 + 10 * gray;
+	c[1] = c[0];
+	c[2] = c[0];
+	if (color_dist(r, g, b, c) < k)
+		return (232 + gray);
+	return (16 + 36 * cube[0] + 6 * cube[1] + cube[2]);
+}
+
+// Closest of the 16 ANSI colors to r, g, b.
+int nearest_16(int r, int g, int b)
+{
+	int	best;
+	int	i;
+
+	best = 0;
+	i = 1;
+	while (i < 16)
 	{
-		ray->stepY = 1;
-		ray->sideDistY = (ray->mapY + 1.0 - player->y) * ray->deltaDistY;
+		if (color_dist(r, g, b, ansi16_rgb[i]) < color_dist(r, g, b, ansi16_rgb[best]))
+			best = i;
+		i++;
 	}
+	return (best);
 }
 
-// Executes the DDA loop to find where the ray hits a wall on the map.
-// At each step, it advances the ray to the next tile in either X or Y direction,
-// based on which side is closer. It stops when a wall (a '1' cell) is hit.
-// Finally, computes the perpendicular distance from the player to the wall.
-// (https://en.wikipedia.org/wiki/Digital_differential_analyzer_(graphics_algorithm))
-void perform_dda(t_ray *ray)
+// Formats the escape selecting r, g, b as background, or as foreground with fg,
+// for the output backend. Returns its length.
+int color_escape(char *out, size_t size, int fg, int r, int g, int b)
 {
-	while (!ray->hit)
+	int	n;
+
+	if (opts.colors == COLORS_256)
+		return (snprintf(out, size, "\033[%d;5;%dm", fg ? 38 : 48, nearest_256(r, g, b)));
+	if (opts.colors == COLORS_16)
 	{
-		if (ray->sideDistX < ray->sideDistY)
-		{
-			ray->sideDistX += ray->deltaDistX;
-			ray->mapX += ray->stepX;
-			ray->side = 0;
-		}
-		else
-		{
-			ray->sideDistY += ray->deltaDistY;
-			ray->mapY += ray->stepY;
-			ray->side = 1;
-		}
-		if (map[ray->mapY][ray->mapX] == '1')
-			ray->hit = 1;
+		n = nearest_16(r, g, b);
+		return (snprintf(out, size, "\033[%dm", (n < 8 ? 40 : 100) + n % 8 - (fg ? 10 : 0)));
 	}
-	if (ray->side == 0)
-		ray->perpWallDist = ray->sideDistX - ray->deltaDistX;
-	else
-		ray->perpWallDist = ray->sideDistY -ray->deltaDistY;
+	return (snprintf(out, size, "\033[%d;2;%d;%d;%dm", fg ? 38 : 48, r, g, b));
 }
 
-// Computes the vertical line (or "slice") on the screen to draw the wall columns,
-// based on how far the wall is from the player.
-// Stores the start and end pixel rows for drawing, and selects a "shaded" color for walls
-void compute_wall_slice(t_ray *ray, int x)
+// Sets palette entry i to the color r, g, b, encoded for the output backend.
+void palette_set(int i, int r, int g, int b)
 {
-	int lineHeight;
-	int start;
-	int end;
-
-	lineHeight = (int)(SCREEN_HEIGHT / ray->perpWallDist);
-	start = -lineHeight / 2 + SCREEN_HEIGHT / 2;
-	end = lineHeight / 2 + SCREEN_HEIGHT / 2;
-	if (start < 0)
-		start = 0;
-	if (end >= SCREEN_HEIGHT)
-		end = SCREEN_HEIGHT - 1;
-	draw_start[x] = start;
-	draw_end[x] = end;
-	wallColor[x] = get_shade(ray->perpWallDist);
+	palette[i].rgb[0] = r;
+	palette[i].rgb[1] = g;
+	palette[i].rgb[2] = b;
+	palette[i].len = color_escape(palette[i].seq, sizeof(palette[i].seq), 0, r, g, b);
+	palette[i].fg_len = color_escape(palette[i].fg, sizeof(palette[i].fg), 1, r, g, b);
 }
 
-// The main render loop.
-// For each vertical column on the screen, a ray is cast, DDA is performed,
-// and a wall slice is computed and stored.
-// Then the screen is drawn line by line, by printing each pixel column with
-// sky, wall, or floor color accordingly.
-// draw_start[x] is top of the wall slice in column x
-// draw_end[x] is bottom of the wall slice in column x
-void render(t_player player)
+// Picks the output backend from the environment : truecolor when COLORTERM says so,
+// xterm-256 when TERM does, ANSI-16 otherwise.
+int detect_colors(void)
 {
-	int x, y;
-	t_ray ray;
+	const char	*env;
 
-	x = 0;
-	clear_screen();
-	while (x < SCREEN_WIDTH)
-	{
-		init_ray(&ray, x, &player);
-		compute_initial_steps(&ray, &player);
-		perform_dda(&ray);
-		compute_wall_slice(&ray, x);
-		x++;
-	}
-	y = 0;
-	while (y < SCREEN_HEIGHT)
-	{
-		x = 0;
-		while (x < SCREEN_WIDTH)
-		{
-			if (y < draw_start[x])
-				printf(SKY_BG PIXEL_CHAR RESET);
-			else if (y <= draw_end[x])
-				printf("%s" PIXEL_CHAR RESET, wallColor[x]);
-			else
-				printf(FLOOR_BG PIXEL_CHAR RESET);
-			x++;
-		}
-		printf("\n");
-		y++;
-	}
+	env = getenv("COLORTERM");
+	if (env && (strcmp(env, "truecolor") == 0 || strcmp(env, "24bit") == 0))
+		return (COLORS_TRUE);
+	env = getenv("TERM");
+	if (env && strstr(env, "256color"))
+		return (COLORS_256);
+	return (COLORS_16);
+}
+
+// Tone of texel (tx, ty) of the brick texture : bricks 8 texels wide and 4 high,
+// every other row shifted by half a brick, with mortar between them.
+int texture_tone(int tx, int ty)
+{
+	if (ty % 4 == 3 || (tx + ty / 4 % 2 * 4) % 8 == 7)
+		return (1);
+	return (0);
 }
 
-// Returns 1 if a key has been pressed (non-blocking), 0 otherwise.
-// Temporarily puts terminal in non-canonical, non-blocking mode,
-// checks for input, then restores terminal state.
-int kbhit(void)
-{
-	struct termios oldt;
-	struct termios newt;
-	int ch;
-	int oldf;
-
-	tcgetattr(0, &oldt);
-	newt = oldt;
-	newt.c_lflag &= ~(ICANON | ECHO);
-	tcsetattr(0, TCSANOW, &newt);
-	oldf = fcntl(0, F_GETFL, 0);
-	fcntl(0, F_SETFL, oldf | O_NONBLOCK);
-	ch = getchar();
-	tcsetattr(0, TCSANOW, &oldt);
-	fcntl(0, F_SETFL, oldf);
-	if (ch != EOF)
-		return (ungetc(ch, stdin), 1);
+// Tone of texel (tx, ty) of the door texture : planks 4 texels wide, in a frame.
+int door_tone(int tx, int ty)
+{
+	if (tx % 4 == 0 || tx == TEX_SIZE - 1 || ty == 0 || ty == TEX_SIZE - 1)
+		return (1);
 	return (0);
 }
 
-// Minimal getch implementation
-// Reads a single character from stdin without waiting for Enter
-// and without echoing the input to the terminal.
-// Temporarily sets the terminal to non-canonical, no-echo mode.
-char getch()
+// Builds one copy of the textures per wall shade, with its tones as palette entries
+// following the wall shades.
+void texture_build(int levels)
 {
-	char buf;
-	struct termios old = {0};
+	const unsigned char	*c;
+	int					pal;
+	int					i;
+	int					tx;
+	int					ty;
 
-	buf = 0;
-	if (tcgetattr(0, &old) < 0) 
-		perror("tcsetattr()");
-	old.c_lflag &= ~ICANON;
-	old.c_lflag &= ~ECHO;
-	tcsetattr(0, TCSANOW, &old);
-	read(0, &buf, 1);
-	old.c_lflag |= ICANON;
-	old.c_lflag |= ECHO;
-	tcsetattr(0, TCSADRAIN, &old);
-	return (buf);
+	i = 0;
+	while (i < levels)
+	{
+		c = palette[PAL_WALL + i].rgb;
+		pal = PAL_WALL + levels + i * TEX_TONES;
+		palette_set(pal, c[0], c[1], c[2]);
+		palette_set(pal + 1, c[0] * TEX_MORTAR, c[1] * TEX_MORTAR, c[2] * TEX_MORTAR);
+		tx = 0;
+		while (tx < TEX_SIZE)
+		{
+			ty = 0;
+			while (ty < TEX_SIZE)
+			{
+				textures[i][tx][ty] = pal + texture_tone(tx, ty);
+				textures[i][TEX_SIZE + tx][ty] = pal + door_tone(tx, ty);
+				ty++;
+			}
+			tx++;
+		}
+		i++;
+	}
 }
 
-//moves the player.
-//?
-void move_player(t_player *p, char key)
+// Builds the fogged floor and ceiling textures : square tiles with grout along two edges.
+// A fog level dims the tiles as much as its wall shade is dimmer than the closest one.
+// Fog levels map onto the wall shades evenly, as many as fit in what is left of the palette.
+void floor_build(int levels)
 {
-	float moveSpeed;
-	float rotSpeed;
-	float newX;
-	float newY;
-	float oldDirX;
-	float oldPlaneX;
+	const unsigned char	tiles[2][3] = { {FLOOR_TILE}, {CEILING_TILE} };
+	float				dim;
+	int					fogs;
+	int					pal;
+	int					i;
+	int					k;
+	int					t;
 
-	moveSpeed = 0.1;
-	rotSpeed = 0.05;
-	if (key == 'w') //move forward
+	pal = PAL_WALL + levels * (1 + TEX_TONES);
+	fogs = (256 - pal) / 4 < levels ? (256 - pal) / 4 : levels;
+	i = 0;
+	while (i < fogs)
 	{
-		newX = p->x + p->dirX * moveSpeed;
-		newY = p->y + p->dirY * moveSpeed;
-		if (map[(int)newY][(int)p->x] != '1') p->y = newY;
-		if (map[(int)p->y][(int)newX] != '1') p->x = newX;
+		dim = (float)palette[PAL_WALL + i * (levels - 1) / (fogs > 1 ? fogs - 1 : 1)].rgb[0]
+			/ palette[PAL_WALL].rgb[0];
+		k = 0;
+		while (k < 4)
+		{
+			t = k & 1 ? 1 : 0;
+			palette_set(pal + i * 4 + k,
+				tiles[k / 2][0] * dim * (t ? TILE_GROUT : 1.0f),
+				tiles[k / 2][1] * dim * (t ? TILE_GROUT : 1.0f),
+				tiles[k / 2][2] * dim * (t ? TILE_GROUT : 1.0f));
+			k++;
+		}
+		k = 0;
+		while (k < TEX_SIZE * TEX_SIZE)
+		{
+			t = k / TEX_SIZE == 0 || k % TEX_SIZE == 0;
+			floor_tex[i][0][k / TEX_SIZE][k % TEX_SIZE] = pal + i * 4 + t;
+			floor_tex[i][1][k / TEX_SIZE][k % TEX_SIZE] = pal + i * 4 + 2 + t;
+			k++;
+		}
+		i++;
 	}
-	if (key == 's') // move backward
+	i = 0;
+	while (i < levels)
 	{
-		newX = p->x - p->dirX * moveSpeed;
-		newY = p->y - p->dirY * moveSpeed;
-		if (map[(int)newY][(int)p->x] != '1') p->y = newY;
-		if (map[(int)p->y][(int)newX] != '1') p->x = newX;
+		shade_fog[i] = fogs > 1 ? (i * (fogs - 1) + (levels - 1) / 2) / (levels - 1) : 0;
+		i++;
 	}
-	if (key == 'a') // strafe left
+}
+
+// Sprite shapes, one row per string : '#' the sprite's color, '+' its shadow,
+// anything else see-through. The bottom row stands on the floor.
+const char	*sprite_shapes[SPRITE_KINDS][SPRITE_SIZE] =
+{
 	{
-		newX = p->x - p->planeX * moveSpeed;
-		newY = p->y - p->planeY * moveSpeed;
-		if (map[(int)newY][(int)p->x] != '1') p->y = newY;
-		if (map[(int)p->y][(int)newX] != '1') p->x = newX;
+		"........",
+		"........",
+		"..####..",
+		".#++++#.",
+		".######.",
+		".######.",
+		".#++++#.",
+		"..####..",
+	},
+	{
+		"...##...",
+		"...##...",
+		"..####..",
+		".#.##.#.",
+		"...##...",
+		"..+..+..",
+		"..+..+..",
+		"..+..+..",
+	},
+};
+
+// Builds the sprite textures and their palette entries.
+void sprite_build(void)
+{
+	const unsigned char	colors[SPRITE_KINDS][3] = { {OBJECT_COLOR}, {PEER_COLOR} };
+	const unsigned char	*c;
+	int					pal;
+	int					k;
+	int					tx;
+	int					ty;
+
+	k = 0;
+	while (k < SPRITE_KINDS)
+	{
+		c = colors[k];
+		pal = PAL_SPRITE + k * SPRITE_TONES;
+		palette_set(pal, c[0], c[1], c[2]);
+		palette_set(pal + 1, c[0] * SPRITE_SHADOW, c[1] * SPRITE_SHADOW, c[2] * SPRITE_SHADOW);
+		ty = 0;
+		while (ty < SPRITE_SIZE)
+		{
+			tx = 0;
+			while (tx < SPRITE_SIZE)
+			{
+				sprite_tex[k][ty][tx] = sprite_shapes[k][ty][tx] == '#' ? pal
+					: sprite_shapes[k][ty][tx] == '+' ? pal + 1 : 0;
+				tx++;
+			}
+			ty++;
+		}
+		k++;
 	}
-	if (key == 'd') // strafe right
+}
+
+// Builds the palette and the distance to shade lookup for the given number of wall shades.
+// The minimap's player markers are its floor color with their glyph on top.
+// With SHADE_LEVELS these are the RED_* ones with their thresholds, otherwise a gradient
+// running through all of them, evenly spread up to SHADE_FAR.
+// Shades that the backend encodes the same way are merged into the first of them
+// in the lookup, so composing never emits the same escape twice in a row.
+void palette_build(int levels)
+{
+	const char			*dir_chars[4] = { DIR_CHAR_UP, DIR_CHAR_DOWN, DIR_CHAR_LEFT, DIR_CHAR_RIGHT };
+	t_color				*c;
+	const unsigned char	*a;
+	const unsigned char	*b;
+	float				pos;
+	float				t;
+	float				dist;
+	int					i;
+	int					k;
+
+	palette_set(PAL_SKY, SKY_BG);
+	palette_set(PAL_FLOOR, FLOOR_BG);
+	palette_set(PAL_MM_WALL, WALL_COLOR);
+	palette_set(PAL_MM_FLOOR, FLOOR_COLOR);
+	palette_set(PAL_MM_BORDER, BORDER_COLOR);
+	i = 0;
+	while (i < 4)
 	{
-		newX = p->x + p->planeX * moveSpeed;
-		newY = p->y + p->planeY * moveSpeed;
-		if (map[(int)newY][(int)p->x] != '1') p->y = newY;
-		if (map[(int)p->y][(int)newX] != '1') p->x = newX;
+		c = &palette[PAL_MM_PLAYER + i];
+		palette_set(PAL_MM_PLAYER + i, PLAYER_COLOR);
+		memcpy(c->seq, palette[PAL_MM_FLOOR].seq, sizeof(c->seq));
+		c->len = palette[PAL_MM_FLOOR].len;
+		c->glyph = dir_chars[i];
+		c->glyph_len = strlen(dir_chars[i]);
+		i++;
 	}
-	if (key == 'e') // rotate left
+	i = 0;
+	while (i < levels)
 	{
-		oldDirX = p->dirX;
-		p->dirX = p->dirX * cos(rotSpeed) - p->dirY * sin(rotSpeed);
-		p->dirY = oldDirX * sin(rotSpeed) + p->dirY * cos(rotSpeed);
-		oldPlaneX = p->planeX;
-		p->planeX = p->planeX * cos(rotSpeed) - p->planeY * sin(rotSpeed);
-		p->planeY = oldPlaneX * sin(rotSpeed) + p->planeY * cos(rotSpeed);
+		pos = (float)i * (SHADE_LEVELS - 1) / (levels - 1);
+		k = pos < SHADE_LEVELS - 1 ? (int)pos : SHADE_LEVELS - 2;
+		t = pos - k;
+		a = shade_rgb[k];
+		b = shade_rgb[k + 1];
+		palette_set(PAL_WALL + i, a[0] + (b[0] - a[0]) * t + 0.5f,
+			a[1] + (b[1] - a[1]) * t + 0.5f, a[2] + (b[2] - a[2]) * t + 0.5f);
+		i++;
 	}
-	if (key == 'q') // rotate right
+	i = 0;
+	while (i < SHADE_LUT_SIZE)
 	{
-		oldDirX = p->dirX;
-		p->dirX = p->dirX * cos(-rotSpeed) - p->dirY * sin(-rotSpeed);
-		p->dirY = oldDirX * sin(-rotSpeed) + p->dirY * cos(-rotSpeed);
-		oldPlaneX = p->planeX;
-		p->planeX = p->planeX * cos(-rotSpeed) - p->planeY * sin(-rotSpeed);
-		p->planeY = oldPlaneX * sin(-rotSpeed) + p->planeY * cos(-rotSpeed);
+		dist = (float)i / SHADE_LUT_STEPS;
+		k = 0;
+		if (levels == SHADE_LEVELS)
+			while (k < SHADE_LEVELS - 1 && dist >= shade_dist[k])
+				k++;
+		else
+			k = dist * levels / SHADE_FAR;
+		k = k < levels ? k : levels - 1;
+		while (k > 0 && strcmp(palette[PAL_WALL + k - 1].seq, palette[PAL_WALL + k].seq) == 0)
+			k--;
+		shade_lut[i++] = PAL_WALL + k;
 	}
+	sprite_build();
+	if (opts.textures)
+		texture_build(levels);
+	if (opts.floor)
+		floor_build(levels);
 }
 
-void print_tab(char **t)
+// Appends len bytes to the frame buffer.
+void frame_append(t_frame *f, const char *s, size_t len)
 {
-	while(*t)
-		printf("%s\n",*t++);
+	memcpy(f->data + f->len, s, len);
+	f->len += len;
 }
 
-int main()
+// Writes the whole frame buffer to fd, retrying on partial writes and signals.
+void frame_flush(t_frame *f, int fd)
 {
-	t_player player;
-	char c;
-	int y;
-	int x;
+	size_t	done;
+	ssize_t	n;
 
-	y = 0;
-	while (y < MAP_HEIGHT)
+	done = 0;
+	while (done < f->len)
 	{
-		x = 0;
-		while (x < MAP_WIDTH)
-		{
-			if (map[y][x] == 'P')
-			{
-				player.x = x + 0.5;
-				player.y = y + 0.5;
-				player.dirX = 0;
-				player.dirY = -1;
-				player.planeX = 0.66;
-				player.planeY = 0;
-			}
-			x++;
-		}
-		y++;
+		n = write(fd, f->data + done, f->len - done);
+		if (n < 0 && errno == EINTR)
+			continue ;
+		if (n <= 0)
+			break ;
+		done += n;
 	}
-	while (1)
+	f->len = 0;
+}
+
+// Appends len bytes taken from run, a string of run_len bytes repeated as many times as needed.
+void frame_append_repeat(t_frame *f, const char *run, size_t run_len, size_t len)
+{
+	while (len > run_len)
+	{
+		frame_append(f, run, run_len);
+		len -= run_len;
+	}
+	frame_append(f, run, len);
+}
+
+// Clears terminal.
+void clear_screen(t_frame *f)
+{
+	frame_append(f, CLEAR_SEQ, sizeof(CLEAR_SEQ) - 1);
+	STAT(f->escapes += 2);
+}
+
+// Returns 1 for the cell values that stop rays and the player : walls and closed doors.
+static inline int cell_value_solid(uint8_t c)
+{
+	return (c == CELL_WALL || c == CELL_DOOR);
+}
+
+// Returns 1 if the cell at (x, y) is a wall, from the bit-packed grid.
+// No bounds checks : rays can't leave the map thanks to its border.
+static inline int cell_solid(int x, int y)
+{
+	return ((map.solid[(size_t)y * map.solid_stride + (x >> 6)] >> (x & 63)) & 1);
+}
+
+// Returns 1 if the block containing cell (x, y) has no wall.
+static inline int block_empty(int x, int y)
+{
+	return (!map.blocks[(size_t)(y >> BLOCK_SHIFT) * map.blocks_stride + (x >> BLOCK_SHIFT)]);
+}
+
+// Sets the row lengths of the acceleration structures for the map's size.
+void map_strides(void)
+{
+	map.solid_stride = (map.width + 63) / 64;
+	map.solid_t_stride = (map.height + 63) / 64;
+	map.blocks_stride = (map.width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Builds the bit-packed solidity grids (by rows and by columns) and the block counts
+// from the cells. Prebuilt maps already have them.
+int map_build_accel(void)
+{
+	size_t	i;
+	int		x, y;
+
+	if (map.prebuilt)
+		return (0);
+	map_strides();
+	map.solid = calloc((size_t)map.solid_stride * map.height, sizeof(uint64_t));
+	map.solid_t = calloc((size_t)map.solid_t_stride * map.width, sizeof(uint64_t));
+	map.blocks = calloc((size_t)map.blocks_stride
+		* ((map.height + BLOCK_SIZE - 1) / BLOCK_SIZE), 1);
+	if (!map.solid || !map.solid_t || !map.blocks)
+		return (perror("map"), -1);
+	y = 0;
+	while (y < map.height)
+	{
+		x = 0;
+		while (x < map.width)
+		{
+			i = (size_t)y * map.width + x;
+			if (cell_value_solid(map.cells[i]))
+			{
+				map.solid[(size_t)y * map.solid_stride + (x >> 6)] |= 1ULL << (x & 63);
+				map.solid_t[(size_t)x * map.solid_t_stride + (y >> 6)] |= 1ULL << (y & 63);
+				map.blocks[(size_t)(y >> BLOCK_SHIFT) * map.blocks_stride + (x >> BLOCK_SHIFT)]++;
+			}
+			x++;
+		}
+		y++;
+	}
+	return (0);
+}
+
+// Returns 1 if the cell at (x, y) blocks the player. Anything outside the map does.
+int map_solid(int x, int y)
+{
+	if (x < 0 || y < 0 || x >= map.width || y >= map.height)
+		return (1);
+	return (cell_value_solid(map.cells[(size_t)y * map.width + x]));
+}
+
+// Allocates an empty w * h map (border not included) surrounded by walls.
+int map_alloc(int w, int h)
+{
+	int	x, y;
+
+	if (w < 1 || h < 1 || w > 65536 - 2 || h > 65536 - 2)
+	{
+		fprintf(stderr, "map: bad size %dx%d\n", w, h);
+		return (-1);
+	}
+	map.width = w + 2;
+	map.height = h + 2;
+	map.cells = calloc((size_t)map.width * map.height, 1);
+	if (!map.cells)
+	{
+		perror("map");
+		return (-1);
+	}
+	y = 0;
+	while (y < map.height)
+	{
+		x = 0;
+		while (x < map.width)
+		{
+			if (x == 0 || y == 0 || x == map.width - 1 || y == map.height - 1)
+				map.cells[(size_t)y * map.width + x] = CELL_WALL;
+			x++;
+		}
+		y++;
+	}
+	map.spawnX = 1.5;
+	map.spawnY = 1.5;
+	return (0);
+}
+
+// Loads a text map from NULL-terminated lines, in the same format as default_map.
+// Lines can be of different lengths, missing cells are empty.
+int map_from_lines(char **lines, const char *name)
+{
+	int	w, h;
+	int	x, y;
+	int	len;
+
+	w = 0;
+	h = 0;
+	while (lines[h])
+	{
+		len = strlen(lines[h]);
+		if (len > w)
+			w = len;
+		h++;
+	}
+	if (map_alloc(w, h) < 0)
+		return (-1);
+	y = 0;
+	while (y < h)
+	{
+		x = 0;
+		while (lines[y][x])
+		{
+			if (lines[y][x] == '1')
+				map.cells[(size_t)(y + 1) * map.width + x + 1] = CELL_WALL;
+			else if (lines[y][x] == 'o')
+				map.cells[(size_t)(y + 1) * map.width + x + 1] = CELL_OBJECT;
+			else if (lines[y][x] == 'D')
+				map.cells[(size_t)(y + 1) * map.width + x + 1] = CELL_DOOR;
+			else if (lines[y][x] == 'P')
+			{
+				map.spawnX = x + 1.5;
+				map.spawnY = y + 1.5;
+			}
+			else if (lines[y][x] != '0' && lines[y][x] != ' ')
+			{
+				fprintf(stderr, "%s:%d: unknown map cell '%c'\n", name, y + 1, lines[y][x]);
+				return (-1);
+			}
+			x++;
+		}
+		y++;
+	}
+	return (0);
+}
+
+// Loads a text map file : one line per row of the map, same format as default_map.
+int map_load_text(const char *path, char *data, size_t size)
+{
+	char	**lines;
+	size_t	count;
+	size_t	i;
+	int		ret;
+
+	count = 1;
+	i = 0;
+	while (i < size)
+	{
+		count += data[i] == '\n' || data[i] == '\r';
+		i++;
+	}
+	lines = malloc((count + 1) * sizeof(char *));
+	if (!lines)
+		return (perror("map"), -1);
+	count = 0;
+	lines[count++] = data;
+	i = 0;
+	while (i < size)
+	{
+		// An empty line is an empty row, only the \n of a \r\n pair doesn't start one.
+		// A newline ending the file doesn't either.
+		if (data[i] == '\n' || data[i] == '\r')
+		{
+			if (!(data[i] == '\r' && i + 1 < size && data[i + 1] == '\n') && i + 1 < size)
+				lines[count++] = data + i + 1;
+			data[i] = 0;
+		}
+		i++;
+	}
+	lines[count] = NULL;
+	ret = map_from_lines(lines, path);
+	free(lines);
+	return (ret);
+}
+
+// Maps a binary map file. The file is cells ready to use, so loading is a single mmap(2)
+// and the header and border checks, even for huge maps. Layout, in host byte order :
+//   char     magic[8]    MAP_MAGIC
+//   uint32_t width       including the border
+//   uint32_t height
+//   uint32_t spawnX      cell where the player starts
+//   uint32_t spawnY
+//   uint8_t  cells[width * height]   CELL_* values, row-major
+int map_load_binary(const char *path, int fd, size_t size)
+{
+	uint32_t	header[4];
+	uint8_t		*base;
+	int			x, y;
+
+	// Writable for doors, a private mapping keeps the file as it is.
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED)
+		return (perror(path), -1);
+	memcpy(header, base + 8, sizeof(header));
+	map.mapped = base;
+	map.mapped_size = size;
+	map.width = header[0];
+	map.height = header[1];
+	map.cells = base + MAP_HEADER_SIZE;
+	map.spawnX = header[2] + 0.5;
+	map.spawnY = header[3] + 0.5;
+	if (header[0] < 3 || header[1] < 3 || header[0] > 65536 || header[1] > 65536
+		|| size - MAP_HEADER_SIZE < (size_t)header[0] * header[1]
+		|| header[2] >= header[0] || header[3] >= header[1])
+	{
+		fprintf(stderr, "%s: corrupted map header\n", path);
+		return (-1);
+	}
+	x = 0;
+	while (x < map.width && map.cells[x] == CELL_WALL
+		&& map.cells[(size_t)(map.height - 1) * map.width + x] == CELL_WALL)
+		x++;
+	y = 0;
+	while (y < map.height && map.cells[(size_t)y * map.width] == CELL_WALL
+		&& map.cells[(size_t)y * map.width + map.width - 1] == CELL_WALL)
+		y++;
+	if (x != map.width || y != map.height)
+	{
+		fprintf(stderr, "%s: map is not surrounded by walls\n", path);
+		return (-1);
+	}
+	return (0);
+}
+
+// Sections of a prebuilt map, in the order they are stored.
+enum { SECTION_CELLS, SECTION_SOLID, SECTION_SOLID_T, SECTION_BLOCKS,
+	SECTION_OBJECT_GRID, SECTION_OBJECTS, SECTIONS };
+
+// Sets the offset and length of every section of a prebuilt map of the map's size
+// holding count objects. The map's strides must be set.
+void map_sections(size_t *off, size_t *len, size_t count)
+{
+	size_t	grid;
+	int		i;
+
+	grid = (size_t)((map.width + SPRITE_GRID_SIZE - 1) >> SPRITE_GRID_SHIFT)
+		* ((map.height + SPRITE_GRID_SIZE - 1) >> SPRITE_GRID_SHIFT);
+	len[SECTION_CELLS] = (size_t)map.width * map.height;
+	len[SECTION_SOLID] = (size_t)map.solid_stride * map.height * sizeof(uint64_t);
+	len[SECTION_SOLID_T] = (size_t)map.solid_t_stride * map.width * sizeof(uint64_t);
+	len[SECTION_BLOCKS] = (size_t)map.blocks_stride * ((map.height + BLOCK_SIZE - 1) / BLOCK_SIZE);
+	len[SECTION_OBJECT_GRID] = (grid + 1) * sizeof(int32_t);
+	len[SECTION_OBJECTS] = count * sizeof(uint32_t);
+	off[0] = MAP_ALIGN;
+	i = 1;
+	while (i < SECTIONS)
+	{
+		off[i] = (off[i - 1] + len[i - 1] + MAP_ALIGN - 1) & ~(size_t)(MAP_ALIGN - 1);
+		i++;
+	}
+}
+
+// Maps a prebuilt map file, written by map_save(). Everything a frame reads is in it,
+// in the layout it is used in, so nothing is read or built at load time
+// and only the parts of the map around the player are ever read in (see map_prefetch()).
+// The file is a MAP_ALIGN header followed by the sections, each aligned on MAP_ALIGN :
+//   char     magic[8]    MAP_MAGIC_PREBUILT
+//   uint32_t width, height, spawnX, spawnY    as in binary maps
+//   uint32_t objects     number of objects
+//   cells, solid, solid_t, blocks, object_grid, objects    as in t_map and t_sprites
+// Its border is not checked here, it would read every row : map_prefetch() enforces it instead.
+int map_load_prebuilt(const char *path, int fd, size_t size)
+{
+	uint32_t	header[5];
+	size_t		off[SECTIONS];
+	size_t		len[SECTIONS];
+	uint8_t		*base;
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED)
+		return (perror(path), -1);
+	memcpy(header, base + 8, sizeof(header));
+	map.mapped = base;
+	map.mapped_size = size;
+	map.width = header[0];
+	map.height = header[1];
+	map.spawnX = header[2] + 0.5;
+	map.spawnY = header[3] + 0.5;
+	if (header[0] < 3 || header[1] < 3 || header[0] > 65536 || header[1] > 65536
+		|| header[2] >= header[0] || header[3] >= header[1]
+		|| header[4] > (size_t)header[0] * header[1])
+	{
+		fprintf(stderr, "%s: corrupted map header\n", path);
+		return (-1);
+	}
+	map_strides();
+	map_sections(off, len, header[4]);
+	if (size < off[SECTION_OBJECTS] + len[SECTION_OBJECTS]
+		|| *(int32_t *)(base + off[SECTION_OBJECT_GRID] + len[SECTION_OBJECT_GRID]
+			- sizeof(int32_t)) != (int32_t)header[4])
+	{
+		fprintf(stderr, "%s: truncated map\n", path);
+		return (-1);
+	}
+	map.cells = base + off[SECTION_CELLS];
+	map.solid = (uint64_t *)(base + off[SECTION_SOLID]);
+	map.solid_t = (uint64_t *)(base + off[SECTION_SOLID_T]);
+	map.blocks = base + off[SECTION_BLOCKS];
+	sprites.object_grid = (int32_t *)(base + off[SECTION_OBJECT_GRID]);
+	sprites.objects = (uint32_t *)(base + off[SECTION_OBJECTS]);
+	map.prebuilt = 1;
+	return (0);
+}
+
+// Hints the kernel to read in len bytes at p of a mapped map, from the start of their page.
+static void map_willneed(const void *p, size_t len)
+{
+	static uintptr_t	page;
+	uintptr_t			start;
+
+	if (!page)
+		page = sysconf(_SC_PAGESIZE);
+	start = (uintptr_t)p & ~(page - 1);
+	madvise((void *)start, (uintptr_t)p + len - start, MADV_WILLNEED);
+}
+
+// Makes cell (x, y) of a prebuilt map's border a wall, writing only what is wrong
+// so that a good map keeps sharing its pages with the file.
+static void map_fix_border(int x, int y)
+{
+	uint64_t	*row;
+	uint64_t	*col;
+	uint8_t		*block;
+
+	row = &map.solid[(size_t)y * map.solid_stride + (x >> 6)];
+	col = &map.solid_t[(size_t)x * map.solid_t_stride + (y >> 6)];
+	block = &map.blocks[(size_t)(y >> BLOCK_SHIFT) * map.blocks_stride + (x >> BLOCK_SHIFT)];
+	if (map.cells[(size_t)y * map.width + x] != CELL_WALL)
+		map.cells[(size_t)y * map.width + x] = CELL_WALL;
+	if (!(*row >> (x & 63) & 1))
+		*row |= 1ULL << (x & 63);
+	if (!(*col >> (y & 63) & 1))
+		*col |= 1ULL << (y & 63);
+	if (!*block)
+		*block = 1;
+}
+
+// Reads in the cells x0 to x1 of rows y0 to y1 of a prebuilt map, with everything built
+// from them, and makes sure the map's border is walls there.
+static void map_read_in(int x0, int y0, int x1, int y1)
+{
+	int		x, y;
+	int		b;
+
+	if (x0 >= x1 || y0 >= y1)
+		return ;
+	y = y0;
+	while (y < y1)
+	{
+		map_willneed(map.cells + (size_t)y * map.width + x0, x1 - x0);
+		map_willneed(map.solid + (size_t)y * map.solid_stride + (x0 >> 6),
+			(((x1 + 63) >> 6) - (x0 >> 6)) * sizeof(uint64_t));
+		if (x0 == 0)
+			map_fix_border(0, y);
+		if (x1 == map.width)
+			map_fix_border(map.width - 1, y);
+		y++;
+	}
+	x = x0;
+	while (x < x1)
+	{
+		map_willneed(map.solid_t + (size_t)x * map.solid_t_stride + (y0 >> 6),
+			(((y1 + 63) >> 6) - (y0 >> 6)) * sizeof(uint64_t));
+		if (y0 == 0)
+			map_fix_border(x, 0);
+		if (y1 == map.height)
+			map_fix_border(x, map.height - 1);
+		x++;
+	}
+	y = y0 >> BLOCK_SHIFT;
+	while (y <= (y1 - 1) >> BLOCK_SHIFT)
+	{
+		map_willneed(map.blocks + (size_t)y * map.blocks_stride + (x0 >> BLOCK_SHIFT),
+			((x1 - 1) >> BLOCK_SHIFT) - (x0 >> BLOCK_SHIFT) + 1);
+		y++;
+	}
+	y = y0 >> SPRITE_GRID_SHIFT;
+	while (y <= (y1 - 1) >> SPRITE_GRID_SHIFT)
+	{
+		b = y * sprites.grid_w;
+		map_willneed(sprites.object_grid + b + (x0 >> SPRITE_GRID_SHIFT),
+			(((x1 - 1) >> SPRITE_GRID_SHIFT) - (x0 >> SPRITE_GRID_SHIFT) + 2) * sizeof(int32_t));
+		y++;
+	}
+}
+
+// Reads in the part of a prebuilt map the casts of pose p can reach, and a little more
+// ahead of it : the chunks around the point half the view radius in front of the camera,
+// far enough that rays stopped at the view radius never leave them.
+// Only chunks that weren't already read in for the screen are, when that point moves to
+// another chunk. Nothing is dropped : pages of the file are clean, the kernel reclaims them.
+void map_prefetch(t_screen *scr, t_player *p)
+{
+	int		r[4];
+	int		*old;
+	int		cx, cy;
+	int		k;
+
+	if (!map.prebuilt)
+		return ;
+	cx = (int)fminf(fmaxf(p->x + p->dirX * opts.view_radius / 2, 0), map.width - 1);
+	cy = (int)fminf(fmaxf(p->y + p->dirY * opts.view_radius / 2, 0), map.height - 1);
+	cx >>= CHUNK_SHIFT;
+	cy >>= CHUNK_SHIFT;
+	// The camera is within r / 2 plus half a chunk's diagonal of the chunk's center,
+	// and rays reach at most 1.2 r plus a block past it.
+	k = 2 * opts.view_radius / CHUNK_SIZE + 2;
+	r[0] = cx - k > 0 ? (cx - k) << CHUNK_SHIFT : 0;
+	r[1] = cy - k > 0 ? (cy - k) << CHUNK_SHIFT : 0;
+	r[2] = (cx + k + 1) << CHUNK_SHIFT;
+	r[3] = (cy + k + 1) << CHUNK_SHIFT;
+	r[2] = r[2] < map.width ? r[2] : map.width;
+	r[3] = r[3] < map.height ? r[3] : map.height;
+	old = scr->prefetch;
+	if (memcmp(r, old, sizeof(r)) == 0)
+		return ;
+	// What isn't in the old rectangle : the rows above and below it, then the sides.
+	map_read_in(r[0], r[1], r[2], old[1] < r[3] ? old[1] : r[3]);
+	map_read_in(r[0], old[3] > r[1] ? old[3] : r[1], r[2], r[3]);
+	cy = old[1] > r[1] ? old[1] : r[1];
+	k = old[3] < r[3] ? old[3] : r[3];
+	map_read_in(r[0], cy, old[0] < r[2] ? old[0] : r[2], k);
+	map_read_in(old[2] > r[0] ? old[2] : r[0], cy, r[2], k);
+	memcpy(old, r, sizeof(r));
+}
+
+// Loads a map file, prebuilt or binary if it starts with their magic, text otherwise.
+int map_load(const char *path)
+{
+	struct stat	st;
+	char		magic[8];
+	char		*data;
+	int			fd;
+	int			ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		return (perror(path), -1);
+	if (st.st_size >= MAP_ALIGN && read(fd, magic, 8) == 8
+		&& memcmp(magic, MAP_MAGIC_PREBUILT, 8) == 0)
+	{
+		ret = map_load_prebuilt(path, fd, st.st_size);
+		close(fd);
+		return (ret);
+	}
+	if (st.st_size >= MAP_HEADER_SIZE && pread(fd, magic, 8, 0) == 8
+		&& memcmp(magic, MAP_MAGIC, 8) == 0)
+	{
+		ret = map_load_binary(path, fd, st.st_size);
+		close(fd);
+		return (ret);
+	}
+	data = malloc(st.st_size + 1);
+	ret = -1;
+	if (data && pread(fd, data, st.st_size, 0) == st.st_size)
+	{
+		data[st.st_size] = 0;
+		ret = map_load_text(path, data, st.st_size);
+	}
+	else
+		perror(path);
+	free(data);
+	close(fd);
+	return (ret);
+}
+
+// Writes the loaded map as a prebuilt map file, see map_load_prebuilt().
+// The sprites and acceleration structures must be built.
+int map_save(const char *path)
+{
+	static const char	zeros[MAP_ALIGN];
+	const void			*data[SECTIONS];
+	size_t				off[SECTIONS];
+	size_t				len[SECTIONS];
+	uint32_t			header[5];
+	FILE				*f;
+	size_t				pos;
+	int					i;
+	int					ok;
+
+	f = fopen(path, "wb");
+	if (!f)
+		return (perror(path), -1);
+	header[0] = map.width;
+	header[1] = map.height;
+	header[2] = (uint32_t)map.spawnX;
+	header[3] = (uint32_t)map.spawnY;
+	header[4] = sprites.object_grid[sprites.grid_w * sprites.grid_h];
+	map_sections(off, len, header[4]);
+	data[SECTION_CELLS] = map.cells;
+	data[SECTION_SOLID] = map.solid;
+	data[SECTION_SOLID_T] = map.solid_t;
+	data[SECTION_BLOCKS] = map.blocks;
+	data[SECTION_OBJECT_GRID] = sprites.object_grid;
+	data[SECTION_OBJECTS] = sprites.objects;
+	ok = fwrite(MAP_MAGIC_PREBUILT, 8, 1, f) == 1
+		&& fwrite(header, sizeof(header), 1, f) == 1;
+	pos = 8 + sizeof(header);
+	i = 0;
+	while (ok && i < SECTIONS)
+	{
+		ok = fwrite(zeros, 1, off[i] - pos, f) == off[i] - pos
+			&& fwrite(data[i], 1, len[i], f) == len[i];
+		pos = off[i] + len[i];
+		i++;
+	}
+	if (fclose(f) != 0 || !ok)
+		return (perror(path), -1);
+	return (0);
+}
+
+// Generates a random w * h map for testing : scattered wall blocks of a few cells and objects,
+// reproducible for a given seed, with the player starting in the middle.
+int map_generate(int w, int h, unsigned seed)
+{
+	uint32_t	r;
+	int			x, y;
+	int			cx, cy;
+
+	if (map_alloc(w, h) < 0)
+		return (-1);
+	r = seed * 2654435761u + 1;
+	y = 1;
+	while (y <= h)
+	{
+		x = 1;
+		while (x <= w)
+		{
+			r ^= r << 13;
+			r ^= r >> 17;
+			r ^= r << 5;
+			if (r % 100 < 6)
+			{
+				cy = y;
+				while (cy < y + 1 + (int)(r >> 8) % 3 && cy <= h)
+				{
+					cx = x;
+					while (cx < x + 1 + (int)(r >> 12) % 3 && cx <= w)
+						map.cells[(size_t)cy * map.width + cx++] = CELL_WALL;
+					cy++;
+				}
+			}
+			else if (r % 100 == 6)
+				map.cells[(size_t)y * map.width + x] = CELL_OBJECT;
+			x++;
+		}
+		y++;
+	}
+	map.spawnX = w / 2 + 1.5;
+	map.spawnY = h / 2 + 1.5;
+	y = (int)map.spawnY - 1;
+	while (y <= (int)map.spawnY + 1)
+	{
+		x = (int)map.spawnX - 1;
+		while (x <= (int)map.spawnX + 1)
+			map.cells[(size_t)y * map.width + x++] = CELL_EMPTY;
+		y++;
+	}
+	return (0);
+}
+
+// Distance from the player to the x-side (or y-side) after steps steps along that axis.
+// Every DDA path computes sideDist through this, so they all agree bit for bit.
+static inline t_dist dda_dist(t_dist start, int steps, t_dist delta)
+{
+	return (start + steps * delta);
+}
+
+#ifndef FIXED_DDA
+// Initializes all ray parameters for a single screen column.
+// Computes the ray direction based on the camera plane and player view direction.
+// Sets the initial map tile the ray is in, and calculates the fixed distances (deltaDistX/Y)
+// between x/y-side intersections. Handles division-by-zero by using a very large float.
+void init_ray(t_ray *ray, int column, int width, t_player *player)
+{
+	ray->cameraX = 2 * column / (float)width - 1;
+	ray->rayDirX = player->dirX + player->planeX * ray->cameraX;
+	ray->rayDirY = player->dirY + player->planeY * ray->cameraX;
+	ray->mapX = (int)player->x;
+	ray->mapY = (int)player->y;
+	ray->deltaDistX = 0;
+	ray->deltaDistY = 0;
+
+	if (ray->rayDirX != 0) {
+		ray->deltaDistX = fabs(1 / ray->rayDirX);
+	} else {
+		ray->deltaDistX = 1e30;
+	}
+	if (ray->rayDirY != 0) {
+		ray->deltaDistY = fabs(1 / ray->rayDirY);
+	} else {
+		ray->deltaDistY = 1e30;
+	}
+	ray->hit = 0;
+	ray->dda_steps = 0;
+}
+
+// Based on the ray's direction, this function determines which direction (+/-) to step
+// along the X and Y axes. Also calculates the initial distance from the player's position
+// to the first X or Y side of the current map square.
+void compute_initial_steps(t_ray *ray, t_player *player)
+{
+	if (ray->rayDirX < 0)
+	{
+		ray->stepX = -1;
+		ray->sideDistX = (player->x - ray->mapX) * ray->deltaDistX;
+	}
+	else
+	{
+		ray->stepX = 1;
+		ray->sideDistX = (ray->mapX + 1.0 - player->x) * ray->deltaDistX;
+	}
+	if (ray->rayDirY < 0)
+	{
+		ray->stepY = -1;
+		ray->sideDistY = (player->y - ray->mapY) * ray->deltaDistY;
+	}
+	else
+	{
+		ray->stepY = 1;
+		ray->sideDistY = (ray->mapY + 1.0 - player->y) * ray->deltaDistY;
+	}
+	ray->startDistX = ray->sideDistX;
+	ray->startDistY = ray->sideDistY;
+	ray->stepsX = 0;
+	ray->stepsY = 0;
+}
+#endif
+
+#ifdef FIXED_DDA
+// The player's pose in fixed point, converted once per cast so rays only use integers.
+typedef struct {
+	t_dist	x;
+	t_dist	y;
+	t_dist	dirX;
+	t_dist	dirY;
+	t_dist	planeX;
+	t_dist	planeY;
+} t_fix_pose;
+
+// 1 / x to RECIP_BITS bits for x in [0.5, 1), in 2.30 fixed point, see fix_recip().
+unsigned int	recip_table[1 << RECIP_BITS];
+
+// Fills recip_table with the reciprocal of the middle of each slot.
+void recip_build(void)
+{
+	int	i;
+
+	i = 0;
+	while (i < 1 << RECIP_BITS)
+	{
+		recip_table[i] = (1ULL << (32 + RECIP_BITS)) / ((2 << RECIP_BITS) + 2 * i + 1);
+		i++;
+	}
+}
+
+// 1 / v in fixed point, for v > 0, without dividing : v is x * 2^(k + 1) with x in [0.5, 1),
+// the table gives 1 / x to RECIP_BITS bits, and each Newton step y = y * (2 - x * y)
+// doubles the bits that are right, to about 30 after two steps.
+t_dist fix_recip(t_dist v)
+{
+	unsigned long long	x;
+	unsigned long long	y;
+	int					k;
+
+	k = 63 - __builtin_clzll(v);
+	x = k >= 31 ? (unsigned long long)v >> (k - 31) : (unsigned long long)v << (31 - k);
+	y = recip_table[(x >> (31 - RECIP_BITS)) & ((1 << RECIP_BITS) - 1)];
+	y = y * ((2ULL << 30) - ((x * y) >> 32)) >> 30;
+	y = y * ((2ULL << 30) - ((x * y) >> 32)) >> 30;
+	// 1 / v = (1 / x) * 2^(-k - 1) in units of 2^-FIX_BITS, y being 1 / x in units of 2^-30.
+	k = 2 * FIX_BITS - k - 1 - 30;
+	return (k >= 0 ? (t_dist)(y << k) : (t_dist)(y >> -k));
+}
+
+// Converts the player's pose to fixed point.
+void fix_pose(t_fix_pose *f, t_player *p)
+{
+	f->x = (t_dist)(p->x * FIX_ONE);
+	f->y = (t_dist)(p->y * FIX_ONE);
+	f->dirX = (t_dist)(p->dirX * FIX_ONE);
+	f->dirY = (t_dist)(p->dirY * FIX_ONE);
+	f->planeX = (t_dist)(p->planeX * FIX_ONE);
+	f->planeY = (t_dist)(p->planeY * FIX_ONE);
+}
+
+// Fixed-point init_ray() and compute_initial_steps() : the same, with integers only.
+void init_ray_fixed(t_ray *ray, int column, int width, t_fix_pose *f)
+{
+	ray->cameraX = (2LL * column - width) * FIX_ONE / width;
+	ray->rayDirX = f->dirX + (f->planeX * ray->cameraX >> FIX_BITS);
+	ray->rayDirY = f->dirY + (f->planeY * ray->cameraX >> FIX_BITS);
+	ray->posX = f->x;
+	ray->posY = f->y;
+	ray->mapX = f->x >> FIX_BITS;
+	ray->mapY = f->y >> FIX_BITS;
+	ray->deltaDistX = ray->rayDirX ? fix_recip(llabs(ray->rayDirX)) : FIX_INF;
+	ray->deltaDistY = ray->rayDirY ? fix_recip(llabs(ray->rayDirY)) : FIX_INF;
+	ray->deltaDistX = ray->deltaDistX < FIX_INF ? ray->deltaDistX : FIX_INF;
+	ray->deltaDistY = ray->deltaDistY < FIX_INF ? ray->deltaDistY : FIX_INF;
+	ray->stepX = ray->rayDirX < 0 ? -1 : 1;
+	ray->stepY = ray->rayDirY < 0 ? -1 : 1;
+	if (ray->rayDirX < 0)
+		ray->sideDistX = (f->x - ((t_dist)ray->mapX << FIX_BITS)) * ray->deltaDistX >> FIX_BITS;
+	else
+		ray->sideDistX = ((((t_dist)ray->mapX + 1) << FIX_BITS) - f->x) * ray->deltaDistX >> FIX_BITS;
+	if (ray->rayDirY < 0)
+		ray->sideDistY = (f->y - ((t_dist)ray->mapY << FIX_BITS)) * ray->deltaDistY >> FIX_BITS;
+	else
+		ray->sideDistY = ((((t_dist)ray->mapY + 1) << FIX_BITS) - f->y) * ray->deltaDistY >> FIX_BITS;
+	ray->startDistX = ray->sideDistX;
+	ray->startDistY = ray->sideDistY;
+	ray->stepsX = 0;
+	ray->stepsY = 0;
+	ray->hit = 0;
+	ray->dda_steps = 0;
+}
+#endif
+
+// Moves the ray out of its current block, which has no wall, in one jump.
+// Lands in exactly the cell, with exactly the step counts, stepping cell by cell would reach
+// when first leaving the block :
+//   ax/ay are the steps left along X/Y before crossing the block's edge. The ray leaves through
+//   its X edge if its ax-th X step comes before its ay-th Y step. A Y step is taken when
+//   sideDistY <= sideDistX, so the Y steps taken meanwhile are those at a distance <= that one.
+//   Leaving through the Y edge is the same, with X steps taken only when strictly closer.
+// Both counts are below BLOCK_SIZE, so this is a handful of multiply-adds and no memory access.
+void skip_block(t_ray *ray)
+{
+	int		ax, ay;
+	int		n;
+	t_dist	exitX, exitY;
+
+	ax = ray->stepX > 0 ? BLOCK_SIZE - (ray->mapX & (BLOCK_SIZE - 1)) : (ray->mapX & (BLOCK_SIZE - 1)) + 1;
+	ay = ray->stepY > 0 ? BLOCK_SIZE - (ray->mapY & (BLOCK_SIZE - 1)) : (ray->mapY & (BLOCK_SIZE - 1)) + 1;
+	exitX = dda_dist(ray->startDistX, ray->stepsX + ax - 1, ray->deltaDistX);
+	exitY = dda_dist(ray->startDistY, ray->stepsY + ay - 1, ray->deltaDistY);
+	n = 0;
+	if (exitX < exitY)
+	{
+		while (n < ay && dda_dist(ray->startDistY, ray->stepsY + n, ray->deltaDistY) <= exitX)
+			n++;
+		ray->stepsX += ax;
+		ray->mapX += ax * ray->stepX;
+		ray->stepsY += n;
+		ray->mapY += n * ray->stepY;
+		ray->side = 0;
+	}
+	else
+	{
+		while (n < ax && dda_dist(ray->startDistX, ray->stepsX + n, ray->deltaDistX) < exitY)
+			n++;
+		ray->stepsY += ay;
+		ray->mapY += ay * ray->stepY;
+		ray->stepsX += n;
+		ray->mapX += n * ray->stepX;
+		ray->side = 1;
+	}
+	ray->sideDistX = dda_dist(ray->startDistX, ray->stepsX, ray->deltaDistX);
+	ray->sideDistY = dda_dist(ray->startDistY, ray->stepsY, ray->deltaDistY);
+}
+
+// Executes the DDA loop to find where the ray hits a wall on the map.
+// At each step, it advances the ray to the next tile in either X or Y direction,
+// based on which side is closer. It stops when a wall (a '1' cell) is hit.
+// Blocks without any wall are crossed in one jump by skip_block() (unless --no-skip),
+// so long rays through open space cost one step per block instead of one per cell.
+// Finally, computes the perpendicular distance from the player to the wall :
+// the side distance before the last step.
+// (https://en.wikipedia.org/wiki/Digital_differential_analyzer_(graphics_algorithm))
+void perform_dda(t_ray *ray)
+{
+	while (!ray->hit)
+	{
+		if (!opts.no_skip && block_empty(ray->mapX, ray->mapY))
+			skip_block(ray);
+		else if (ray->sideDistX < ray->sideDistY)
+		{
+			ray->stepsX++;
+			ray->sideDistX = dda_dist(ray->startDistX, ray->stepsX, ray->deltaDistX);
+			ray->mapX += ray->stepX;
+			ray->side = 0;
+		}
+		else
+		{
+			ray->stepsY++;
+			ray->sideDistY = dda_dist(ray->startDistY, ray->stepsY, ray->deltaDistY);
+			ray->mapY += ray->stepY;
+			ray->side = 1;
+		}
+		if (cell_solid(ray->mapX, ray->mapY))
+			ray->hit = 1;
+		else if (ray->sideDistX > dda_limit && ray->sideDistY > dda_limit)
+			ray->hit = 1;
+		STAT(ray->dda_steps++);
+	}
+	if (ray->side == 0)
+		ray->perpWallDist = dda_dist(ray->startDistX, ray->stepsX - 1, ray->deltaDistX);
+	else
+		ray->perpWallDist = dda_dist(ray->startDistY, ray->stepsY - 1, ray->deltaDistY);
+}
+
+// Returns 1 if every cell from lo to hi (in either order) is empty in a row of solidity bits.
+static inline int bits_empty(const uint64_t *bits, int lo, int hi)
+{
+	uint64_t	m;
+	int			w;
+
+	if (lo > hi)
+	{
+		w = lo;
+		lo = hi;
+		hi = w;
+	}
+	w = lo >> 6;
+	m = ~0ULL << (lo & 63);
+	while (w < hi >> 6)
+	{
+		if (bits[w] & m)
+			return (0);
+		m = ~0ULL;
+		w++;
+	}
+	return (!(bits[w] & m & (~0ULL >> (63 - (hi & 63)))));
+}
+
+// Smallest step count n, up to max + 1, whose dda_dist() is past v : >= v, or > v if strict.
+// Guessed with inv, 1 / delta, then corrected with dda_dist() itself so it agrees with the DDA.
+// In fixed point, v past max + 1 steps is not multiplied, (v - start) * inv could overflow.
+static inline int dda_steps_until(t_dist start, t_dist delta, t_dist inv, t_dist v, int strict, int max)
+{
+	int		n;
+	t_dist	f;
+
+#ifdef FIXED_DDA
+	f = v - start < (t_dist)(max + 1) * delta ? (v - start) * inv >> 2 * FIX_BITS : (t_dist)max + 1;
+#else
+	f = (v - start) * inv;
+#endif
+	n = 0;
+	if (f > max)
+		n = max + 1;
+	else if (f > 0)
+		n = (int)f;
+	while (n > 0 && (strict ? dda_dist(start, n - 1, delta) > v : dda_dist(start, n - 1, delta) >= v))
+		n--;
+	while (n <= max && !(strict ? dda_dist(start, n, delta) > v : dda_dist(start, n, delta) >= v))
+		n++;
+	return (n);
+}
+
+// Temporal coherence : when the camera moves a little, most columns hit the same wall cell
+// as the frame before. Checks whether the ray, fresh from compute_initial_steps(), still hits
+// the cell (cx, cy) first, and if it does, leaves it exactly as perform_dda() would have.
+//
+// The DDA reaches (cx, cy) after a fixed number of steps along each axis, ax and ay.
+// Its path crosses the rows in between one after the other, and the cells it visits in a row
+// are a single run : it steps along X in row k while sideDistX < sideDistY, sideDistY being
+// the distance to row k's far side, so the run ends at the first X step count at or past it.
+// Each row is then one dda_steps_until() and one bits_empty() test of its run, instead of
+// a step per cell. The ray hits the cell if every run before it is empty, the run of its row
+// reaches it, and the cell is still a wall. Rays closer to vertical are walked column by
+// column in the transposed grid the same way, a Y step being taken on equal distances.
+// Any cell can be checked, a wrong guess costs a little and falls back to the DDA.
+// A cell past dda_limit is never hit, the DDA stops before it.
+int coherent_hit(t_ray *ray, int cx, int cy)
+{
+	const uint64_t	*bits;
+	t_dist			sa, da, sb, db;
+	t_dist			inv;
+	int				a0, b0, sta, stb;
+	int				ax, ay;
+	int				na, nb;
+	int				k;
+	int				first;
+	int				enter;
+	int				leave;
+	int				rows;
+	int				side;
+
+	ax = (cx - ray->mapX) * ray->stepX;
+	ay = (cy - ray->mapY) * ray->stepY;
+	if (ax < 0 || ay < 0 || ax + ay == 0 || !cell_solid(cx, cy))
+		return (0);
+	// a is the axis along the runs, b the one across them.
+	rows = ay <= ax;
+	sa = rows ? ray->startDistX : ray->startDistY;
+	da = rows ? ray->deltaDistX : ray->deltaDistY;
+	sb = rows ? ray->startDistY : ray->startDistX;
+	db = rows ? ray->deltaDistY : ray->deltaDistX;
+	a0 = rows ? ray->mapX : ray->mapY;
+	b0 = rows ? ray->mapY : ray->mapX;
+	sta = rows ? ray->stepX : ray->stepY;
+	stb = rows ? ray->stepY : ray->stepX;
+	na = rows ? ax : ay;
+	nb = rows ? ay : ax;
+	// Checking costs about as much per run as the DDA does per cell, so it only pays off
+	// for long rays close enough to an axis, with long runs.
+	if (nb * COHERENCE_RUN > na || na < COHERENCE_MIN)
+		return (0);
+#ifdef FIXED_DDA
+	inv = fix_recip(da);
+#else
+	inv = 1 / da;
+#endif
+	STAT(ray->dda_steps++);
+	// First whether the path goes through the cell at all, from where the run of its line
+	// starts : the cell is either its first one, or the ray steps along the run up to it.
+	first = nb ? dda_steps_until(sa, da, inv, dda_dist(sb, nb - 1, db), !rows, na) : 0;
+	if (first > na || (na > first && (rows ? !(dda_dist(sa, na - 1, da) < dda_dist(sb, nb, db))
+		: !(dda_dist(sa, na - 1, da) <= dda_dist(sb, nb, db)))))
+		return (0);
+	// Then whether every cell before it is empty, run by run.
+	enter = 0;
+	k = 0;
+	while (k <= nb)
+	{
+		STAT(ray->dda_steps++);
+		leave = k < nb ? dda_steps_until(sa, da, inv, dda_dist(sb, k, db), !rows, na) : na - 1;
+		bits = rows ? map.solid + (size_t)(b0 + k * stb) * map.solid_stride
+			: map.solid_t + (size_t)(b0 + k * stb) * map.solid_t_stride;
+		if (leave >= enter && !bits_empty(bits, a0 + enter * sta, a0 + leave * sta))
+			return (0);
+		enter = leave;
+		k++;
+	}
+	// Entered through a side along the runs, or across them.
+	side = na > first ? !rows : rows;
+	// The DDA would have stopped at the view radius before, when the cell is past it.
+	if ((side == 0 ? dda_dist(ray->startDistX, ax - 1, ray->deltaDistX)
+		: dda_dist(ray->startDistY, ay - 1, ray->deltaDistY)) > dda_limit)
+		return (0);
+	ray->side = side;
+	ray->stepsX = ax;
+	ray->stepsY = ay;
+	ray->mapX = cx;
+	ray->mapY = cy;
+	ray->sideDistX = dda_dist(ray->startDistX, ax, ray->deltaDistX);
+	ray->sideDistY = dda_dist(ray->startDistY, ay, ray->deltaDistY);
+	ray->hit = 1;
+	if (ray->side == 0)
+		ray->perpWallDist = dda_dist(ray->startDistX, ax - 1, ray->deltaDistX);
+	else
+		ray->perpWallDist = dda_dist(ray->startDistY, ay - 1, ray->deltaDistY);
+	return (1);
+}
+
+// Computes the vertical line (or "slice") on the screen to draw the wall columns,
+// based on how far the wall is from the player.
+// Stores the start and end pixel rows for drawing, and selects a "shaded" color for walls
+// With --textures, also where the ray hit the wall (wallX, from 0 to 1 along the wall),
+// which gives the texture column, and how fast to walk down the texture along the slice,
+// so drawing it later is a single lookup per pixel.
+// Doors are drawn one shade darker than walls, and with the door texture.
+void compute_wall_slice(t_ray *ray, int x, t_columns *cols, t_player *player)
+{
+	int lineHeight;
+	int start;
+	int end;
+	int texX;
+	int door;
+	unsigned int step;
+#ifdef FIXED_DDA
+	t_dist wallX;
+	t_dist shade;
+	t_dist dist;
+	t_dist len;
+
+	// Capped so that walls right in front of the player don't overflow an int.
+	// And taken for a distance a little shorter, see FIX_SLACK.
+	dist = ray->perpWallDist - (ray->perpWallDist >> FIX_SLACK);
+	len = dist > 0 ? ((t_dist)cols->height << FIX_BITS) / dist : 1 << 30;
+	lineHeight = len < 1 << 30 ? (int)len : 1 << 30;
+#else
+	float wallX;
+
+	lineHeight = (int)(cols->height / ray->perpWallDist);
+#endif
+	start = -lineHeight / 2 + cols->height / 2;
+	end = lineHeight / 2 + cols->height / 2;
+	if (start < 0)
+		start = 0;
+	if (end >= cols->height)
+		end = cols->height - 1;
+	cols->draw_start[x] = start;
+	cols->draw_end[x] = end;
+	door = map.cells[(size_t)ray->mapY * map.width + ray->mapX] == CELL_DOOR;
+#ifdef FIXED_DDA
+	(void)player;
+	cols->zbuf[x] = (float)ray->perpWallDist / FIX_ONE;
+	shade = ray->perpWallDist * SHADE_LUT_STEPS >> FIX_BITS;
+	cols->wallColor[x] = shade_lut[shade < SHADE_LUT_SIZE ? shade : SHADE_LUT_SIZE - 1];
+	cols->wallColor[x] += door && cols->wallColor[x] < PAL_WALL + opts.shades - 1;
+	if (!opts.textures)
+		return ;
+	// Rounded to the nearest, as floats would : flooring moves hits right on a texel's edge.
+	if (ray->side == 0)
+		wallX = ray->posY + ((ray->perpWallDist * ray->rayDirY + FIX_ONE / 2) >> FIX_BITS);
+	else
+		wallX = ray->posX + ((ray->perpWallDist * ray->rayDirX + FIX_ONE / 2) >> FIX_BITS);
+	texX = (int)(((wallX & (FIX_ONE - 1)) * TEX_SIZE) >> FIX_BITS);
+#else
+	cols->zbuf[x] = ray->perpWallDist;
+	cols->wallColor[x] = get_shade(ray->perpWallDist);
+	cols->wallColor[x] += door && cols->wallColor[x] < PAL_WALL + opts.shades - 1;
+	if (!opts.textures)
+		return ;
+	if (ray->side == 0)
+		wallX = player->y + ray->perpWallDist * ray->rayDirY;
+	else
+		wallX = player->x + ray->perpWallDist * ray->rayDirX;
+	wallX -= floorf(wallX);
+	texX = (int)(wallX * TEX_SIZE) & (TEX_SIZE - 1);
+#endif
+	// Mirror it on the walls seen from the other side, so textures aren't flipped.
+	if ((ray->side == 0 && ray->rayDirX > 0) || (ray->side == 1 && ray->rayDirY < 0))
+		texX = TEX_SIZE - 1 - texX;
+	if (lineHeight < 1)
+		lineHeight = 1;
+	step = ((unsigned int)TEX_SIZE << 16) / lineHeight;
+	cols->texX[x] = texX + door * TEX_SIZE;
+	cols->texStep[x] = step;
+	cols->texStart[x] = (unsigned int)((long long)(start - cols->height / 2 + lineHeight / 2) * step);
+}
+
+// Appends the cursor move to (row, col), both 0-based.
+// Digits are written backwards into tmp, then copied in order.
+void frame_append_cursor(t_frame *f, int row, int col)
+{
+	char	tmp[CURSOR_ESC_MAX];
+	int		n;
+
+	n = 0;
+	tmp[n++] = 'H';
+	col++;
+	do
+		tmp[n++] = '0' + col % 10;
+	while (col /= 10);
+	tmp[n++] = ';';
+	row++;
+	do
+		tmp[n++] = '0' + row % 10;
+	while (row /= 10);
+	tmp[n++] = '[';
+	tmp[n++] = '\033';
+	while (n)
+		f->data[f->len++] = tmp[--n];
+}
+
+// Casts the floor and the ceiling into the cell grid, row by row in memory order.
+// A row sees the floor (or ceiling) at a single distance, so the world position under its
+// first pixel and the step from one pixel to the next are worked out once per row,
+// then every pixel is two adds and a texture lookup. Walls are drawn over it afterwards.
+void fill_floor(t_screen *scr, t_columns *cols)
+{
+	const unsigned char	*tex;
+	unsigned char		*cells;
+	t_player			*p;
+	double				d;
+	unsigned int		fx, fy;
+	unsigned int		sx, sy;
+	int					x, y;
+
+	p = &cols->pose;
+	cells = scr->cells[scr->cur];
+	y = 0;
+	while (y < cols->height)
+	{
+		d = scr->row_dist[y];
+		tex = floor_tex[scr->row_fog[y]][y < cols->height / 2][0];
+		// Rays of the leftmost and rightmost columns are dir - plane and dir + plane.
+		fx = (long long)((p->x + d * (p->dirX - p->planeX)) * 65536);
+		fy = (long long)((p->y + d * (p->dirY - p->planeY)) * 65536);
+		sx = (long long)(d * 2 * p->planeX / cols->width * 65536);
+		sy = (long long)(d * 2 * p->planeY / cols->width * 65536);
+		x = 0;
+		while (x < cols->width)
+		{
+			*cells++ = tex[(fy >> TEX_SHIFT & (TEX_SIZE - 1)) * TEX_SIZE
+				+ (fx >> TEX_SHIFT & (TEX_SIZE - 1))];
+			fx += sx;
+			fy += sy;
+			x++;
+		}
+		y++;
+	}
+}
+
+// Palette index of map cell i on the minimap.
+static inline unsigned char minimap_pixel(size_t i)
+{
+	return (cell_value_solid(map.cells[i]) ? PAL_MM_WALL : PAL_MM_FLOOR);
+}
+
+// Sizes the minimap's window for the loaded map : the whole map if it fits in MINIMAP_SIZE
+// cells, a window following the player otherwise. Nothing is read from the map until
+// the window is drawn, so huge maps cost nothing more.
+void minimap_build(void)
+{
+	minimap.vw = map.width < MINIMAP_SIZE ? map.width : MINIMAP_SIZE;
+	minimap.vh = map.height < MINIMAP_SIZE ? map.height : MINIMAP_SIZE;
+	memset(minimap.view, PAL_MM_BORDER, sizeof(minimap.view));
+	minimap.ox = -1;
+	minimap.px = -1;
+}
+
+// Moves the minimap's marker to the player's cell and direction, scrolling the window
+// to keep it centered (within the map) when the map is bigger than the window.
+// Nothing is done while both stay the same, the player only turning within a quadrant.
+void minimap_update(t_player *p)
+{
+	int	stride;
+	int	px, py;
+	int	ox, oy;
+	int	dir;
+	int	x, y;
+
+	px = (int)p->x;
+	py = (int)p->y;
+	if (fabsf(p->dirX) > fabsf(p->dirY))
+		dir = PAL_MM_PLAYER + (p->dirX < 0 ? 2 : 3);
+	else
+		dir = PAL_MM_PLAYER + (p->dirY < 0 ? 0 : 1);
+	if (px == minimap.px && py == minimap.py && dir == minimap.dir)
+		return ;
+	ox = px - minimap.vw / 2;
+	ox = ox < 0 ? 0 : ox > map.width - minimap.vw ? map.width - minimap.vw : ox;
+	oy = py - minimap.vh / 2;
+	oy = oy < 0 ? 0 : oy > map.height - minimap.vh ? map.height - minimap.vh : oy;
+	stride = minimap.vw + 2;
+	if (ox == minimap.ox && oy == minimap.oy)
+		minimap.view[(minimap.py - oy + 1) * stride + minimap.px - ox + 1]
+			= minimap_pixel((size_t)minimap.py * map.width + minimap.px);
+	else
+	{
+		y = 0;
+		while (y < minimap.vh)
+		{
+			x = 0;
+			while (x < minimap.vw)
+			{
+				minimap.view[(y + 1) * stride + x + 1] = minimap_pixel((size_t)(oy + y) * map.width + ox + x);
+				x++;
+			}
+			y++;
+		}
+	}
+	minimap.view[(py - oy + 1) * stride + px - ox + 1] = dir;
+	minimap.ox = ox;
+	minimap.oy = oy;
+	minimap.px = px;
+	minimap.py = py;
+	minimap.dir = dir;
+}
+
+// Copies the minimap window over the top left corner of the cell grid, each of its cells
+// filling a whole terminal cell (both pixel rows with --half-block).
+// It is left out when the screen is too small to hold it.
+void minimap_draw(t_screen *scr, t_player *p)
+{
+	unsigned char	*cells;
+	int				stride;
+	int				y;
+
+	stride = minimap.vw + 2;
+	if (stride > scr->width || minimap.vh + 2 > scr->rows)
+		return ;
+	minimap_update(p);
+	cells = scr->cells[scr->cur];
+	y = 0;
+	while (y < (minimap.vh + 2) * scr->half && y < scr->height)
+	{
+		memcpy(cells + (size_t)y * scr->width, minimap.view + y / scr->half * stride, stride);
+		y++;
+	}
+}
+
+// Buckets the map's objects in the sprite grid : objects are counted per bucket first,
+// which tells where each bucket starts, then put in place.
+// Prebuilt maps come with them, already mapped by map_load_prebuilt().
+int sprites_build(void)
+{
+	size_t	n;
+	int32_t	*grid;
+	int		x, y;
+	int		b;
+
+	sprites.grid_w = (map.width + SPRITE_GRID_SIZE - 1) >> SPRITE_GRID_SHIFT;
+	sprites.grid_h = (map.height + SPRITE_GRID_SIZE - 1) >> SPRITE_GRID_SHIFT;
+	if (map.prebuilt)
+		return (0);
+	n = (size_t)sprites.grid_w * sprites.grid_h;
+	grid = calloc(n + 1, sizeof(int32_t));
+	sprites.object_grid = grid;
+	if (!grid)
+		return (perror("sprites"), -1);
+	y = 0;
+	while (y < map.height)
+	{
+		x = 0;
+		while (x < map.width)
+		{
+			if (map.cells[(size_t)y * map.width + x] == CELL_OBJECT)
+				grid[(y >> SPRITE_GRID_SHIFT) * sprites.grid_w + (x >> SPRITE_GRID_SHIFT) + 1]++;
+			x++;
+		}
+		y++;
+	}
+	b = 0;
+	while ((size_t)b < n)
+	{
+		grid[b + 1] += grid[b];
+		b++;
+	}
+	sprites.objects = malloc((grid[n] + 1) * sizeof(uint32_t));
+	if (!sprites.objects)
+		return (perror("sprites"), -1);
+	y = 0;
+	while (y < map.height)
+	{
+		x = 0;
+		while (x < map.width)
+		{
+			if (map.cells[(size_t)y * map.width + x] == CELL_OBJECT)
+			{
+				// grid[b] walks up to where bucket b + 1 starts, shifted back below.
+				b = (y >> SPRITE_GRID_SHIFT) * sprites.grid_w + (x >> SPRITE_GRID_SHIFT);
+				sprites.objects[grid[b]++] = (uint32_t)y << 16 | x;
+			}
+			x++;
+		}
+		y++;
+	}
+	memmove(grid + 1, grid, n * sizeof(int32_t));
+	grid[0] = 0;
+	return (0);
+}
+
+// Adds sprite s to the sprites seen from pose p, seen[] holding count of them,
+// the closest first. It is left out when behind the camera or off the sides
+// of a w columns screen, or when seen[] is full of closer ones.
+// Returns the new count.
+int sprite_see(t_sprite_view *seen, int count, t_sprite *s, t_player *p, float invDet, float cell_w, int w)
+{
+	float	dx, dy;
+	float	camX;
+	float	depth;
+	float	screenX;
+	int		i;
+
+	dx = s->x - p->x;
+	dy = s->y - p->y;
+	// The sprite's position in camera space : along the plane and along the direction.
+	camX = invDet * (p->dirY * dx - p->dirX * dy);
+	depth = invDet * (p->planeX * dy - p->planeY * dx);
+	if (depth < SPRITE_NEAR)
+		return (count);
+	screenX = w / 2 * (1 + camX / depth);
+	if (screenX + cell_w / 2 / depth < 0 || screenX - cell_w / 2 / depth >= w
+		|| (count == SPRITE_MAX && depth >= seen[count - 1].depth))
+		return (count);
+	i = count < SPRITE_MAX ? count++ : count - 1;
+	while (i > 0 && seen[i - 1].depth > depth)
+	{
+		seen[i] = seen[i - 1];
+		i--;
+	}
+	seen[i] = (t_sprite_view){ depth, screenX, s->kind };
+	return (count);
+}
+
+// Draws a sprite seen in a frame as a cell high and wide billboard standing on the floor,
+// like a wall face at the same distance. Only the columns it spans are visited,
+// and each of them only where the wall is behind the sprite.
+void sprite_draw(t_screen *scr, t_columns *cols, t_sprite_view *v, float cell_w)
+{
+	const unsigned char	*tex;
+	unsigned char		*cells;
+	unsigned int		pos;
+	unsigned int		step;
+	float				size;
+	float				left;
+	float				width;
+	int					top, bottom;
+	int					x, end, y;
+
+	size = cols->height / v->depth;
+	width = cell_w / v->depth;
+	left = v->screenX - width / 2;
+	bottom = (int)size / 2 + cols->height / 2;
+	top = bottom - (int)size + 1;
+	x = left > 0 ? (int)left : 0;
+	end = left + width < cols->width ? (int)(left + width) + 1 : cols->width;
+	step = (unsigned int)(((float)SPRITE_SIZE * 65536) / (size > 1 ? size : 1));
+	while (x < end)
+	{
+		tex = &sprite_tex[v->kind][0][(int)((x + 0.5f - left) * SPRITE_SIZE / width) & (SPRITE_SIZE - 1)];
+		if (cols->zbuf[x] > v->depth && x + 0.5f >= left && x + 0.5f < left + width)
+		{
+			cells = scr->cells[scr->cur] + x;
+			y = top > 0 ? top : 0;
+			pos = (unsigned int)((y - top) * step);
+			while (y <= bottom && y < cols->height)
+			{
+				if (tex[(pos >> 16) * SPRITE_SIZE])
+					cells[(size_t)y * cols->width] = tex[(pos >> 16) * SPRITE_SIZE];
+				pos += step;
+				y++;
+			}
+		}
+		x++;
+	}
+}
+
+// Draws the sprites in view of the columns' pose over the walls, the farthest first.
+// Nothing past the farthest wall of the frame can be seen, so only the objects in the
+// buckets under the view triangle reaching that far are looked at.
+void sprites_draw(t_screen *scr, t_columns *cols)
+{
+	t_sprite_view	seen[SPRITE_MAX];
+	t_sprite		object;
+	t_player		*p;
+	float			invDet;
+	float			cell_w;
+	float			far;
+	float			ex[3], ey[3];
+	int				x, y;
+	int				x0, y0, x1, y1;
+	int				b, end;
+	int				total;
+	int				count;
+
+	total = sprites.object_grid[sprites.grid_w * sprites.grid_h];
+	if (!total && !sprites.peer_count)
+		return ;
+	p = &cols->pose;
+	invDet = 1.0f / (p->planeX * p->dirY - p->dirX * p->planeY);
+	cell_w = cols->width / (2 * sqrtf(p->planeX * p->planeX + p->planeY * p->planeY));
+	far = 0;
+	x = 0;
+	while (x < cols->width)
+	{
+		far = cols->zbuf[x] > far ? cols->zbuf[x] : far;
+		x++;
+	}
+	// The view triangle, and the buckets under its bounding box. Objects stand in the
+	// middle of their cell, so half a cell more is enough to catch every one it touches.
+	ex[0] = p->x;
+	ey[0] = p->y;
+	ex[1] = p->x + (p->dirX - p->planeX) * far;
+	ey[1] = p->y + (p->dirY - p->planeY) * far;
+	ex[2] = p->x + (p->dirX + p->planeX) * far;
+	ey[2] = p->y + (p->dirY + p->planeY) * far;
+	x0 = (int)(fminf(ex[0], fminf(ex[1], ex[2])) - 1) >> SPRITE_GRID_SHIFT;
+	x1 = (int)(fmaxf(ex[0], fmaxf(ex[1], ex[2])) + 1) >> SPRITE_GRID_SHIFT;
+	y0 = (int)(fminf(ey[0], fminf(ey[1], ey[2])) - 1) >> SPRITE_GRID_SHIFT;
+	y1 = (int)(fmaxf(ey[0], fmaxf(ey[1], ey[2])) + 1) >> SPRITE_GRID_SHIFT;
+	x0 = x0 < 0 ? 0 : x0;
+	y0 = y0 < 0 ? 0 : y0;
+	x1 = x1 < sprites.grid_w ? x1 : sprites.grid_w - 1;
+	y1 = y1 < sprites.grid_h ? y1 : sprites.grid_h - 1;
+	count = 0;
+	y = y0;
+	while (y <= y1)
+	{
+		x = x0;
+		while (x <= x1)
+		{
+			// Clamped, the grid of a prebuilt map comes from a file.
+			b = sprites.object_grid[y * sprites.grid_w + x];
+			end = sprites.object_grid[y * sprites.grid_w + x + 1];
+			end = end < total ? end : total;
+			while (b >= 0 && b < end)
+			{
+				object = (t_sprite){ (sprites.objects[b] & 0xffff) + 0.5f,
+					(sprites.objects[b] >> 16) + 0.5f, SPRITE_OBJECT, NULL };
+				count = sprite_see(seen, count, &object, p, invDet, cell_w, cols->width);
+				b++;
+			}
+			x++;
+		}
+		y++;
+	}
+	b = 0;
+	while (b < sprites.peer_count)
+	{
+		if (sprites.peers[b].owner != scr)
+			count = sprite_see(seen, count, &sprites.peers[b], p, invDet, cell_w, cols->width);
+		b++;
+	}
+	while (count > 0)
+		sprite_draw(scr, cols, &seen[--count], cell_w);
+}
+
+// Fills a cell grid from the column buffers : sky above the wall slice, floor below.
+// With --textures, wall pixels are read from each column's texture column instead,
+// stepping down it by texStep per row.
+// With --floor, the floor and ceiling are cast first by fill_floor(), then only walls are drawn.
+// Sprites go over the walls in front of them, and the minimap over everything.
+// Filled column by column, so each column's bounds and place in its texture stay
+// in registers. The grid of a frame is small enough to stay in cache.
+void fill_cells(t_screen *scr, t_columns *cols)
+{
+	unsigned char		*cells;
+	const unsigned char	*tex;
+	unsigned int		pos;
+	unsigned int		step;
+	int					x, y;
+	int					w;
+
+	if (opts.floor)
+		fill_floor(scr, cols);
+	w = cols->width;
+	x = 0;
+	while (x < w)
+	{
+		cells = scr->cells[scr->cur] + x;
+		y = 0;
+		if (opts.floor)
+			y = cols->draw_start[x];
+		while (y < cols->draw_start[x])
+			cells[(size_t)y++ * w] = PAL_SKY;
+		if (opts.textures)
+		{
+			tex = textures[cols->wallColor[x] - PAL_WALL][cols->texX[x]];
+			pos = cols->texStart[x];
+			step = cols->texStep[x];
+			while (y <= cols->draw_end[x])
+			{
+				cells[(size_t)y++ * w] = tex[pos >> 16 & (TEX_SIZE - 1)];
+				pos += step;
+			}
+		}
+		while (y <= cols->draw_end[x])
+			cells[(size_t)y++ * w] = cols->wallColor[x];
+		while (!opts.floor && y < cols->height)
+			cells[(size_t)y++ * w] = PAL_FLOOR;
+		x++;
+	}
+	sprites_draw(scr, cols);
+	if (opts.minimap)
+		minimap_draw(scr, &cols->pose);
+}
+
+// Appends n terminal cells whose top and bottom pixels are the colors top and bottom.
+// fg and bg track the colors the terminal currently has (-1 when unknown),
+// only the ones that change are emitted. A cell of a single color is PIXEL_CHAR
+// on that background, one of two colors (only with --half-block) is DIR_CHAR_UP
+// with the top color as foreground. Cells of a color with a glyph are that glyph instead.
+void append_cells(t_screen *scr, int top, int bottom, int n, int *fg, int *bg)
+{
+	t_frame	*f;
+	int		i;
+
+	f = &scr->frame;
+	if (bottom != *bg)
+	{
+		*bg = bottom;
+		frame_append(f, palette[bottom].seq, palette[bottom].len);
+		STAT(f->escapes++);
+	}
+	if (top == bottom && !palette[top].glyph)
+	{
+		frame_append_repeat(f, PIXEL_RUN, sizeof(PIXEL_RUN) - 1, (size_t)n * scr->pixel);
+		return ;
+	}
+	if (top != *fg)
+	{
+		*fg = top;
+		frame_append(f, palette[top].fg, palette[top].fg_len);
+		STAT(f->escapes++);
+	}
+	if (top == bottom)
+	{
+		i = n * scr->pixel / (sizeof(PIXEL_CHAR) - 1);
+		while (i--)
+			frame_append(f, palette[top].glyph, palette[top].glyph_len);
+		return ;
+	}
+	frame_append_repeat(f, HALF_RUN, sizeof(HALF_RUN) - 1, (size_t)n * scr->pixel
+		/ (sizeof(PIXEL_CHAR) - 1) * (sizeof(DIR_CHAR_UP) - 1));
+}
+
+// Top and bottom pixel rows of terminal row y in a cell grid.
+// Both are the same row, except with --half-block.
+void cell_rows(t_screen *scr, unsigned char *cells, int y,
+	unsigned char **top, unsigned char **bottom)
+{
+	int	last;
+
+	last = y * scr->half + scr->half - 1;
+	if (last >= scr->height)
+		last = scr->height - 1;
+	*top = cells + (size_t)y * scr->half * scr->width;
+	*bottom = cells + (size_t)last * scr->width;
+}
+
+// Composes the full frame from a cell grid, row by row.
+// A color escape is only emitted when the color changes along a row,
+// so a run of sky or of the same wall shade costs one escape followed by its pixels.
+void compose_frame(t_screen *scr)
+{
+	int				x, y;
+	int				run;
+	int				fg, bg;
+	unsigned char	*top;
+	unsigned char	*bottom;
+
+	y = 0;
+	while (y < scr->rows)
+	{
+		cell_rows(scr, scr->cells[scr->cur], y, &top, &bottom);
+		fg = -1;
+		bg = -1;
+		x = 0;
+		while (x < scr->width)
+		{
+			run = x + 1;
+			while (run < scr->width && top[run] == top[x] && bottom[run] == bottom[x])
+				run++;
+			append_cells(scr, top[x], bottom[x], run - x, &fg, &bg);
+			x = run;
+		}
+		frame_append(&scr->frame, RESET "\n", sizeof(RESET "\n") - 1);
+		STAT(scr->frame.escapes++);
+		y++;
+	}
+}
+
+// Composes only what changed between the frame the terminal shows (prev) and the new one (cur).
+// Each run of changed cells costs a cursor move, then its cells with the same color elision
+// as compose_frame(). The terminal keeps the current colors across cursor moves,
+// so they are tracked over the whole frame. Nothing is appended if nothing changed.
+void compose_delta(t_screen *scr)
+{
+	int				x, y;
+	int				end;
+	int				scan;
+	int				run;
+	int				fg, bg;
+	unsigned char	*top, *bottom;
+	unsigned char	*ptop, *pbottom;
+
+	fg = -1;
+	bg = -1;
+	y = 0;
+	while (y < scr->rows)
+	{
+		cell_rows(scr, scr->cells[scr->cur], y, &top, &bottom);
+		cell_rows(scr, scr->cells[!scr->cur], y, &ptop, &pbottom);
+		x = 0;
+		while (x < scr->width)
+		{
+			if (top[x] == ptop[x] && bottom[x] == pbottom[x])
+			{
+				x++;
+				continue ;
+			}
+			// Extend the run while the next changed cell is close enough.
+			end = x + 1;
+			scan = end;
+			while (scan < scr->width && scan - end < DELTA_GAP_MERGE)
+			{
+				if (top[scan] != ptop[scan] || bottom[scan] != pbottom[scan])
+					end = scan + 1;
+				scan++;
+			}
+			frame_append_cursor(&scr->frame, y, x * scr->pixel);
+			STAT(scr->frame.escapes++);
+			while (x < end)
+			{
+				run = x + 1;
+				while (run < end && top[run] == top[x] && bottom[run] == bottom[x])
+					run++;
+				append_cells(scr, top[x], bottom[x], run - x, &fg, &bg);
+				x = run;
+			}
+		}
+		y++;
+	}
+	if (bg >= 0)
+	{
+		frame_append(&scr->frame, RESET, sizeof(RESET) - 1);
+		STAT(scr->frame.escapes++);
+	}
+}
+
+// Appends the n low bytes of v to the frame, little-endian.
+void wire_put(t_frame *f, unsigned long long v, int n)
+{
+	while (n--)
+	{
+		f->data[f->len++] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+// Appends v to the frame as a LEB128 varint.
+void wire_varint(t_frame *f, unsigned long long v)
+{
+	while (v >= 0x80)
+	{
+		f->data[f->len++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	f->data[f->len++] = v;
+}
+
+// Appends the header of a message of the given type, its length is filled in by wire_end().
+size_t wire_begin(t_frame *f, int type)
+{
+	f->data[f->len++] = type;
+	f->len += 4;
+	return (f->len);
+}
+
+// Sets the length of the message whose payload starts at start to whatever was appended since.
+void wire_end(t_frame *f, size_t start)
+{
+	size_t	len;
+
+	len = f->len;
+	f->len = start - 4;
+	wire_put(f, len - start, 4);
+	f->len = len;
+}
+
+// Appends the whole palette, with each entry's colors as RGB so the client can encode them
+// for its own terminal.
+void wire_palette(t_frame *f)
+{
+	t_color	*c;
+	t_color	*b;
+	size_t	start;
+	int		i;
+
+	start = wire_begin(f, WIRE_PALETTE);
+	wire_put(f, 256, 2);
+	i = 0;
+	while (i < 256)
+	{
+		c = &palette[i++];
+		// Glyphs (the minimap's player marker) are drawn on the minimap floor's background.
+		b = c->glyph ? &palette[PAL_MM_FLOOR] : c;
+		wire_put(f, b->rgb[0] | b->rgb[1] << 8 | b->rgb[2] << 16, 3);
+		f->data[f->len++] = c->glyph ? c->glyph_len : 0;
+		if (!c->glyph)
+			continue ;
+		wire_put(f, c->rgb[0] | c->rgb[1] << 8 | c->rgb[2] << 16, 3);
+		frame_append(f, c->glyph, c->glyph_len);
+	}
+	wire_end(f, start);
+}
+
+// Binary counterpart of compose_frame() and compose_delta() : the cells that changed
+// since the previous frame as runs of one palette index, or every cell for a full frame.
+// A run goes on over unchanged cells of its index, cheaper than starting another one.
+// As with ANSI, nothing is appended when no cell changed.
+void compose_binary(t_screen *scr)
+{
+	t_frame			*f;
+	unsigned char	*cur;
+	unsigned char	*prev;
+	size_t			start;
+	int				full;
+	int				n;
+	int				i;
+	int				run;
+	int				last;
+
+	f = &scr->frame;
+	full = opts.full_redraw || !scr->valid;
+	if (full)
+		wire_palette(f);
+	start = wire_begin(f, WIRE_FRAME);
+	f->data[f->len++] = (full ? WIRE_FULL : 0) | (scr->half == 2 ? WIRE_HALF : 0);
+	wire_put(f, scr->width, 2);
+	wire_put(f, scr->height, 2);
+	f->data[f->len++] = scr->pixel;
+	cur = scr->cells[scr->cur];
+	prev = scr->cells[!scr->cur];
+	n = scr->width * scr->height;
+	last = 0;
+	i = 0;
+	while (i < n)
+	{
+		if (!full && cur[i] == prev[i])
+		{
+			i++;
+			continue ;
+		}
+		run = i + 1;
+		while (run < n && cur[run] == cur[i])
+			run++;
+		wire_varint(f, i - last);
+		wire_varint(f, run - i);
+		f->data[f->len++] = cur[i];
+		STAT(f->escapes++);
+		i = run;
+		last = run;
+	}
+	if (!full && f->len == start + 6)
+		f->len = start - WIRE_HEADER;
+	else
+		wire_end(f, start);
+	scr->valid = 1;
+}
+
+// Appends the HUD line as a WIRE_HUD message.
+void wire_text(t_frame *f, const char *text)
+{
+	size_t	start;
+
+	start = wire_begin(f, WIRE_HUD);
+	frame_append(f, text, strlen(text));
+	wire_end(f, start);
+}
+
+// Where the ray (rx, ry) was in the last cast : the column of prev whose cameraX points
+// closest to it, and in off how far from it, in columns. -1 if it was out of view.
+static inline int turn_column(t_hits *prev, int width, float rx, float ry, float *off)
+{
+	t_player	*o;
+	float		u;
+	float		pos;
+	int			k;
+
+	o = &prev->pose;
+	u = rx * o->dirX + ry * o->dirY;
+	if (!(u > 0))
+		return (-1);
+	pos = ((rx * o->planeX + ry * o->planeY) / (o->planeX * o->planeX + o->planeY * o->planeY)
+		/ u + 1) * width / 2;
+	if (!(pos > -0.5f && pos < width - 0.5f))
+		return (-1);
+	k = (int)(pos + 0.5f);
+	*off = pos - k;
+	return (k);
+}
+
+// With --turn-reuse, sets up the ray of a column from the hit of column k of the last cast
+// when only the direction changed and k pointed within TURN_REUSE_TOLERANCE columns of it :
+// the wall point k hit is kept, its distance projected on the new direction.
+// Only columns that were cast are reused, so the error never builds up over frames.
+// Returns 0 when the column has to be cast.
+static inline int turn_reuse(t_ray *ray, t_hits *prev, t_player *player, int width, int k, float off)
+{
+	t_player	*o;
+	float		c;
+
+	o = &prev->pose;
+	if (!opts.turn_reuse || k < 0 || fabsf(off) > TURN_REUSE_TOLERANCE || !prev->exact[k]
+		|| o->x != player->x || o->y != player->y)
+		return (0);
+	c = 2 * k / (float)width - 1;
+	ray->perpWallDist = prev->dist[k] * ((o->dirX + o->planeX * c) * player->dirX
+		+ (o->dirY + o->planeY * c) * player->dirY);
+	ray->side = prev->side[k];
+	ray->mapX = prev->x[k];
+	ray->mapY = prev->y[k];
+	return (1);
+}
+
+// Records the hit of column x, exact when it was cast rather than reused.
+static inline void record_hit(t_hits *next, int x, t_ray *ray, int exact)
+{
+	next->x[x] = ray->mapX;
+	next->y[x] = ray->mapY;
+	next->dist[x] = ray->perpWallDist;
+	next->side[x] = ray->side;
+	next->exact[x] = exact;
+}
+
+#endif
+
+#ifdef RAY_PACKET
+typedef float	t_vf __attribute__((vector_size(PACKET_WIDTH * sizeof(float))));
+typedef int		t_vi __attribute__((vector_size(PACKET_WIDTH * sizeof(int))));
+
+// PACKET_WIDTH adjacent rays, stored as one vector per t_ray field (structure of arrays),
+// so each DDA step advances every lane at once. active has all bits set for lanes
+// that haven't hit a wall yet, lanes that hit are masked off and keep their state.
+// Every lane does exactly the same float operations as the scalar path,
+// so both give the same perpWallDist bit for bit.
+typedef struct {
+	t_vf	rayDirX;
+	t_vf	rayDirY;
+	t_vf	deltaDistX;
+	t_vf	deltaDistY;
+	t_vf	sideDistX;
+	t_vf	sideDistY;
+	t_vf	startDistX;
+	t_vf	startDistY;
+	t_vi	stepsX;
+	t_vi	stepsY;
+	t_vi	mapX;
+	t_vi	mapY;
+	t_vi	stepX;
+	t_vi	stepY;
+	t_vi	side;
+	t_vi	active;
+	t_vf	perpWallDist;
+	int		dda_steps;	// DDA iterations summed over the lanes, for the stats
+} t_ray_packet;
+
+// Lane select : a where mask is set, b elsewhere.
+static inline t_vf vselect(t_vi mask, t_vf a, t_vf b)
+{
+	return ((t_vf)((mask & (t_vi)a) | (~mask & (t_vi)b)));
+}
+
+// Integer lane select.
+static inline t_vi vselecti(t_vi mask, t_vi a, t_vi b)
+{
+	return ((mask & a) | (~mask & b));
+}
+
+// Vector dda_dist().
+static inline t_vf dda_dist_v(t_vf start, t_vi steps, t_vf delta)
+{
+	return (start + __builtin_convertvector(steps, t_vf) * delta);
+}
+
+// Returns 1 if any lane of the mask is set.
+static inline int vany(t_vi mask)
+{
+	int	i;
+
+	i = 0;
+	while (i < PACKET_WIDTH)
+		if (mask[i++])
+			return (1);
+	return (0);
+}
+
+// Packet version of init_ray() and compute_initial_steps(), for columns [column, column + PACKET_WIDTH).
+void init_packet(t_ray_packet *pk, int column, int width, t_player *player)
+{
+	t_vf	cameraX;
+	t_vf	px;
+	t_vf	py;
+	t_vi	neg;
+	int		i;
+
+	i = 0;
+	while (i < PACKET_WIDTH)
+	{
+		cameraX[i] = 2 * (column + i) / (float)width - 1;
+		i++;
+	}
+	px = (t_vf){0} + player->x;
+	py = (t_vf){0} + player->y;
+	pk->rayDirX = player->dirX + player->planeX * cameraX;
+	pk->rayDirY = player->dirY + player->planeY * cameraX;
+	pk->mapX = (t_vi){0} + (int)player->x;
+	pk->mapY = (t_vi){0} + (int)player->y;
+	// fabs() is clearing the sign bit.
+	pk->deltaDistX = vselect(pk->rayDirX != 0, 1 / pk->rayDirX, (t_vf){0} + 1e30f);
+	pk->deltaDistX = (t_vf)((t_vi)pk->deltaDistX & 0x7fffffff);
+	pk->deltaDistY = vselect(pk->rayDirY != 0, 1 / pk->rayDirY, (t_vf){0} + 1e30f);
+	pk->deltaDistY = (t_vf)((t_vi)pk->deltaDistY & 0x7fffffff);
+	neg = pk->rayDirX < 0;
+	pk->stepX = neg | 1;
+	pk->sideDistX = vselect(neg, (px - __builtin_convertvector(pk->mapX, t_vf)) * pk->deltaDistX,
+		(__builtin_convertvector(pk->mapX + 1, t_vf) - px) * pk->deltaDistX);
+	neg = pk->rayDirY < 0;
+	pk->stepY = neg | 1;
+	pk->sideDistY = vselect(neg, (py - __builtin_convertvector(pk->mapY, t_vf)) * pk->deltaDistY,
+		(__builtin_convertvector(pk->mapY + 1, t_vf) - py) * pk->deltaDistY);
+	pk->startDistX = pk->sideDistX;
+	pk->startDistY = pk->sideDistY;
+	pk->stepsX = (t_vi){0};
+	pk->stepsY = (t_vi){0};
+	pk->side = (t_vi){0};
+	pk->active = (t_vi){0} - 1;
+	pk->dda_steps = 0;
+}
+
+// Packet version of skip_block(), computed for every lane and applied to the lanes in skip.
+// Each lane gets the same result as skip_block() would give on its own.
+void skip_block_packet(t_ray_packet *pk, t_vi skip)
+{
+	t_vi	ax, ay;
+	t_vi	nx, ny;
+	t_vi	dx, dy;
+	t_vi	viaX;
+	t_vf	exitX, exitY;
+	int		j;
+
+	ax = pk->mapX & (BLOCK_SIZE - 1);
+	ax = vselecti(pk->stepX > 0, BLOCK_SIZE - ax, ax + 1);
+	ay = pk->mapY & (BLOCK_SIZE - 1);
+	ay = vselecti(pk->stepY > 0, BLOCK_SIZE - ay, ay + 1);
+	exitX = dda_dist_v(pk->startDistX, pk->stepsX + ax - 1, pk->deltaDistX);
+	exitY = dda_dist_v(pk->startDistY, pk->stepsY + ay - 1, pk->deltaDistY);
+	viaX = exitX < exitY;
+	nx = (t_vi){0};
+	ny = (t_vi){0};
+	j = 0;
+	while (j < BLOCK_SIZE)
+	{
+		ny -= (j < ay) & (dda_dist_v(pk->startDistY, pk->stepsY + j, pk->deltaDistY) <= exitX);
+		nx -= (j < ax) & (dda_dist_v(pk->startDistX, pk->stepsX + j, pk->deltaDistX) < exitY);
+		j++;
+	}
+	dx = vselecti(viaX, ax, nx) & skip;
+	dy = vselecti(viaX, ny, ay) & skip;
+	pk->stepsX += dx;
+	pk->stepsY += dy;
+	pk->mapX += dx * pk->stepX;
+	pk->mapY += dy * pk->stepY;
+	pk->side = vselecti(skip, ~viaX & 1, pk->side);
+}
+
+// Packet version of perform_dda().
+// Lanes sitting in an empty block jump out of it (see skip_block_packet()), while the
+// other active lanes take their next step, all at once. Then each lane that is still active
+// checks its own cell and is masked off once it hits a wall. Runs until all lanes hit.
+void perform_packet_dda(t_ray_packet *pk)
+{
+	t_vi	stepx;
+	t_vi	stepy;
+	t_vi	skip;
+	t_vi	moving;
+	int		i;
+
+	skip = (t_vi){0};
+	while (vany(pk->active))
+	{
+		moving = pk->active;
+		if (!opts.no_skip)
+		{
+			i = 0;
+			while (i < PACKET_WIDTH)
+			{
+				skip[i] = pk->active[i] && block_empty(pk->mapX[i], pk->mapY[i]) ? -1 : 0;
+				i++;
+			}
+			if (vany(skip))
+				skip_block_packet(pk, skip);
+			moving &= ~skip;
+		}
+		stepx = (pk->sideDistX < pk->sideDistY) & moving;
+		stepy = ~stepx & moving;
+		pk->stepsX -= stepx;
+		pk->mapX += pk->stepX & stepx;
+		pk->stepsY -= stepy;
+		pk->mapY += pk->stepY & stepy;
+		pk->side = (pk->side & ~moving) | (stepy & 1);
+		pk->sideDistX = dda_dist_v(pk->startDistX, pk->stepsX, pk->deltaDistX);
+		pk->sideDistY = dda_dist_v(pk->startDistY, pk->stepsY, pk->deltaDistY);
+		i = 0;
+		while (i < PACKET_WIDTH)
+		{
+			STAT(pk->dda_steps -= pk->active[i]);
+			if (pk->active[i] && cell_solid(pk->mapX[i], pk->mapY[i]))
+				pk->active[i] = 0;
+			i++;
+		}
+		pk->active &= ~((pk->sideDistX > dda_limit) & (pk->sideDistY > dda_limit));
+	}
+	pk->perpWallDist = vselect(pk->side == 0,
+		dda_dist_v(pk->startDistX, pk->stepsX - 1, pk->deltaDistX),
+		dda_dist_v(pk->startDistY, pk->stepsY - 1, pk->deltaDistY));
+}
+
+// The packet part of cast_columns() : casts the columns from x PACKET_WIDTH at a time,
+// as far as whole packets fit before end, and returns the first column left to cast.
+int cast_packets(t_player *player, t_columns *cols, int x, int end, int turned)
+{
+	t_ray_packet pk;
+	t_ray ray;
+	t_hits *prev;
+	t_vi ax, ay;
+	t_vi check;
+	t_vi reuse;
+	t_vi from;
+	float dist[PACKET_WIDTH];
+	float off;
+	long long steps;
+	long long cached;
+	long long reused;
+	int i;
+
+	steps = 0;
+	cached = 0;
+	reused = 0;
+	prev = cols->prev;
+	off = 0;
+	while (x + PACKET_WIDTH <= end)
+	{
+		init_packet(&pk, x, cols->width, player);
+		// Lanes that still hit their last cell are set up as done before the DDA runs.
+		// Which lanes are worth checking at all (see coherent_hit()) is sorted out at once.
+		reuse = (t_vi){0};
+		i = 0;
+		while (i < PACKET_WIDTH)
+		{
+			from[i] = x + i;
+			if (turned)
+			{
+				from[i] = turn_column(prev, cols->width, pk.rayDirX[i], pk.rayDirY[i], &off);
+				if (turn_reuse(&ray, prev, player, cols->width, from[i], off))
+				{
+					reuse[i] = -1;
+					dist[i] = ray.perpWallDist;
+					pk.side[i] = ray.side;
+				}
+				from[i] = from[i] < 0 ? x + i : from[i];
+			}
+			ax[i] = prev->x[from[i]];
+			ay[i] = prev->y[from[i]];
+			i++;
+		}
+		check = (t_vi){0};
+		if (!opts.no_cache)
+		{
+			ax = (ax - pk.mapX) * pk.stepX;
+			ay = (ay - pk.mapY) * pk.stepY;
+			check = (ax >= 0) & (ay >= 0) & (((ay <= ax) & (ay * COHERENCE_RUN <= ax)
+				& (ax >= COHERENCE_MIN)) | ((ax < ay) & (ax * COHERENCE_RUN <= ay) & (ay >= COHERENCE_MIN)))
+				& ~reuse;
+		}
+		i = 0;
+		while (vany(check) && i < PACKET_WIDTH)
+		{
+			ray.mapX = pk.mapX[i];
+			ray.mapY = pk.mapY[i];
+			ray.stepX = pk.stepX[i];
+			ray.stepY = pk.stepY[i];
+			ray.startDistX = pk.startDistX[i];
+			ray.startDistY = pk.startDistY[i];
+			ray.deltaDistX = pk.deltaDistX[i];
+			ray.deltaDistY = pk.deltaDistY[i];
+			ray.dda_steps = 0;
+			if (check[i] && coherent_hit(&ray, prev->x[from[i]], prev->y[from[i]]))
+			{
+				pk.mapX[i] = ray.mapX;
+				pk.mapY[i] = ray.mapY;
+				pk.stepsX[i] = ray.stepsX;
+				pk.stepsY[i] = ray.stepsY;
+				pk.side[i] = ray.side;
+				pk.active[i] = 0;
+				cached++;
+			}
+			STAT(steps += ray.dda_steps);
+			i++;
+		}
+		pk.active &= ~reuse;
+		perform_packet_dda(&pk);
+		STAT(steps += pk.dda_steps);
+		i = 0;
+		while (i < PACKET_WIDTH)
+		{
+			ray.perpWallDist = reuse[i] ? dist[i] : pk.perpWallDist[i];
+			ray.side = pk.side[i];
+			ray.rayDirX = pk.rayDirX[i];
+			ray.rayDirY = pk.rayDirY[i];
+			ray.mapX = reuse[i] ? prev->x[from[i]] : pk.mapX[i];
+			ray.mapY = reuse[i] ? prev->y[from[i]] : pk.mapY[i];
+			compute_wall_slice(&ray, x + i, cols, player);
+			record_hit(cols->next, x + i, &ray, !reuse[i]);
+			reused -= reuse[i];
+			i++;
+		}
+		x += PACKET_WIDTH;
+	}
+	STAT(__atomic_fetch_add(&cols->steps, steps, __ATOMIC_RELAXED));
+	STAT(__atomic_fetch_add(&cols->cached, cached, __ATOMIC_RELAXED));
+	STAT(__atomic_fetch_add(&cols->reused, reused, __ATOMIC_RELAXED));
+	(void)steps;
+	return (x);
+}
+#endif
+
+#ifndef PACKET_PASS
+# ifdef PACKET_DISPATCH
+// The packet raycaster again, with 8 lanes of AVX2 : the file includes itself, which only
+// leaves the packet code above, with every name of it given an _avx2 suffix.
+// By its name rather than __FILE__, which is the path given to the compiler and
+// wouldn't be found from the file's directory when building from elsewhere.
+#  define PACKET_PASS
+#  undef PACKET_WIDTH
+#  define PACKET_WIDTH 8
+#  define t_vf t_vf_avx2
+#  define t_vi t_vi_avx2
+#  define t_ray_packet t_ray_packet_avx2
+#  define vselect vselect_avx2
+#  define vselecti vselecti_avx2
+#  define dda_dist_v dda_dist_v_avx2
+#  define vany vany_avx2
+#  define init_packet init_packet_avx2
+#  define skip_block_packet skip_block_packet_avx2
+#  define perform_packet_dda perform_packet_dda_avx2
+#  define cast_packets cast_packets_avx2
+#  pragma GCC push_options
+#  pragma GCC target("avx2")
+#  include "cubeascii.c"
+#  pragma GCC pop_options
+#  undef t_vf
+#  undef t_vi
+#  undef t_ray_packet
+#  undef vselect
+#  undef vselecti
+#  undef dda_dist_v
+#  undef vany
+#  undef init_packet
+#  undef skip_block_packet
+#  undef perform_packet_dda
+#  undef cast_packets
+#  undef PACKET_WIDTH
+#  define PACKET_WIDTH 4
+#  undef PACKET_PASS
+# endif
+
+# ifdef RAY_PACKET
+// Lanes of the packet raycaster cast_columns() runs, set in main() from what the CPU supports.
+int packet_lanes = PACKET_WIDTH;
+# endif
+
+// Casts one ray per screen column in [x, end) and stores the resulting wall slices.
+// Columns go through the packet raycaster PACKET_WIDTH at a time when it is available,
+// the remaining columns (and every column with --scalar) through the scalar path.
+// Each ray first tries the cell its column hit in the last cast (see coherent_hit()),
+// or after turning, the cell hit by the column that pointed the closest to it,
+// and with --turn-reuse, its hit as it is.
+void cast_columns(t_player *player, t_columns *cols, int x, int end)
+{
+	t_ray ray;
+	t_hits *prev;
+	long long steps;
+	long long cached;
+	long long reused;
+	int turned;
+	int exact;
+	int k;
+	float off;
+#ifdef FIXED_DDA
+	t_fix_pose fix;
+
+	fix_pose(&fix, player);
+#endif
+
+	steps = 0;
+	cached = 0;
+	reused = 0;
+	prev = cols->prev;
+	turned = prev->valid && (prev->pose.dirX != player->dirX || prev->pose.dirY != player->dirY);
+	off = 0;
+#ifdef FIXED_DDA
+	// --turn-reuse needs float directions, the fixed build has none.
+	turned = 0;
+#endif
+#ifdef RAY_PACKET
+	if (!opts.scalar)
+# ifdef PACKET_DISPATCH
+		x = packet_lanes > PACKET_WIDTH ? cast_packets_avx2(player, cols, x, end, turned)
+			: cast_packets(player, cols, x, end, turned);
+# else
+		x = cast_packets(player, cols, x, end, turned);
+# endif
+#endif
+	while (x < end)
+	{
+#ifdef FIXED_DDA
+		init_ray_fixed(&ray, x, cols->width, &fix);
+#else
+		init_ray(&ray, x, cols->width, player);
+		compute_initial_steps(&ray, player);
+#endif
+		k = turned ? turn_column(prev, cols->width, ray.rayDirX, ray.rayDirY, &off) : x;
+		exact = !turn_reuse(&ray, prev, player, cols->width, k, off);
+		k = k < 0 ? x : k;
+		if (!exact)
+			reused++;
+		else if (!opts.no_cache && coherent_hit(&ray, prev->x[k], prev->y[k]))
+			cached++;
+		else
+			perform_dda(&ray);
+		STAT(steps += ray.dda_steps);
+		compute_wall_slice(&ray, x, cols, player);
+		record_hit(cols->next, x, &ray, exact);
+		x++;
+	}
+	STAT(__atomic_fetch_add(&cols->steps, steps, __ATOMIC_RELAXED));
+	STAT(__atomic_fetch_add(&cols->cached, cached, __ATOMIC_RELAXED));
+	STAT(__atomic_fetch_add(&cols->reused, reused, __ATOMIC_RELAXED));
+	(void)steps;
+	(void)cached;
+	(void)reused;
+}
+
+// The reference caster the others are checked against (see verify_frame()) : every column
+// goes through init_ray(), perform_dda() and compute_wall_slice() as in the textbook
+// raycaster, one cell at a time, without packets, skipped blocks or the last cast's hits.
+void cast_reference(t_player *player, t_columns *cols)
+{
+	t_ray	ray;
+	int		no_skip;
+	int		x;
+#ifdef FIXED_DDA
+	t_fix_pose fix;
+
+	fix_pose(&fix, player);
+#endif
+	no_skip = opts.no_skip;
+	opts.no_skip = 1;
+	x = 0;
+	while (x < cols->width)
+	{
+#ifdef FIXED_DDA
+		init_ray_fixed(&ray, x, cols->width, &fix);
+#else
+		init_ray(&ray, x, cols->width, player);
+		compute_initial_steps(&ray, player);
+#endif
+		perform_dda(&ray);
+		compute_wall_slice(&ray, x, cols, player);
+		record_hit(cols->next, x, &ray, 1);
+		x++;
+	}
+	opts.no_skip = no_skip;
+}
+
+// Sets a column set up for a cast of the given pose : it starts from the hits of the last
+// cast and fills the other ones, which are then the latest. Casts never overlap,
+// so two sets of hits are enough even with the workers pipelined.
+// The part of a prebuilt map they can reach is read in first.
+void cast_begin(t_screen *scr, t_columns *cols, t_player *player)
+{
+	map_prefetch(scr, player);
+	cols->pose = *player;
+	cols->prev = &scr->hits[scr->hits_cur];
+	cols->next = &scr->hits[!scr->hits_cur];
+	cols->next->pose = *player;
+	cols->next->valid = 1;
+	scr->hits_cur = !scr->hits_cur;
+	STAT(cols->steps = 0);
+	STAT(cols->cached = 0);
+	STAT(cols->reused = 0);
+}
+
+// Persistent worker pool casting columns, TILE_COLUMNS at a time.
+// A job is one frame : the player's pose and the column set to fill.
+// Workers sleep on wake between jobs, claim tiles from next_tile until none are left,
+// and the last one to finish signals done. The pool only ever runs one job at a time.
+typedef struct {
+	pthread_t		threads[64];
+	int				count;
+	pthread_mutex_t	lock;
+	pthread_cond_t	wake;
+	pthread_cond_t	done;
+	unsigned		job;		// Bumped for every new job
+	int				running;	// Workers still busy on the current job
+	int				next_tile;	// Next tile to claim, updated atomically
+	t_player		player;
+	t_columns		*cols;
+} t_pool;
+
+t_pool	pool;
+
+// Worker thread : waits for a job, casts tiles until the frame is done, repeat.
+void *pool_worker(void *arg)
+{
+	unsigned	seen;
+	int			tile;
+	int			x;
+	int			end;
+
+	(void)arg;
+	seen = 0;
+	pthread_mutex_lock(&pool.lock);
+	while (1)
+	{
+		while (pool.job == seen)
+			pthread_cond_wait(&pool.wake, &pool.lock);
+		seen = pool.job;
+		pthread_mutex_unlock(&pool.lock);
+		while ((tile = __atomic_fetch_add(&pool.next_tile, 1, __ATOMIC_RELAXED))
+			* TILE_COLUMNS < pool.cols->width)
+		{
+			x = tile * TILE_COLUMNS;
+			end = x + TILE_COLUMNS;
+			if (end > pool.cols->width)
+				end = pool.cols->width;
+			cast_columns(&pool.player, pool.cols, x, end);
+		}
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.running == 0)
+		{
+			STAT(pool.cols->cast_ns += now_ns());
+			pthread_cond_signal(&pool.done);
+		}
+	}
+	return (NULL);
+}
+
+// Starts count worker threads. Returns 0 if none could be started.
+int pool_start(int count)
+{
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.wake, NULL);
+	pthread_cond_init(&pool.done, NULL);
+	if (count > (int)(sizeof(pool.threads) / sizeof(*pool.threads)))
+		count = sizeof(pool.threads) / sizeof(*pool.threads);
+	while (pool.count < count
+		&& pthread_create(&pool.threads[pool.count], NULL, pool_worker, NULL) == 0)
+		pool.count++;
+	return (pool.count);
+}
+
+// Hands a frame to the workers and returns immediately.
+void pool_dispatch(t_player *player, t_columns *cols)
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.player = *player;
+	pool.cols = cols;
+	STAT(cols->cast_ns = -now_ns());
+	pool.next_tile = 0;
+	pool.running = pool.count;
+	pool.job++;
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+// Blocks until the workers are done with the current frame.
+void pool_wait(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	while (pool.running)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+// Carves the next size bytes out of the arena, keeping every buffer cache line aligned.
+void *arena_take(char **next, size_t size)
+{
+	void	*p;
+
+	p = *next;
+	*next += (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+	return (p);
+}
+
+// Lays out every buffer of a w * h screen with p characters per pixel in the arena.
+// Called with a NULL arena, only computes the arena size.
+size_t screen_layout(t_screen *scr, char *arena, int w, int h, int p)
+{
+	t_screen	tmp;
+	char		*next;
+	int			i;
+
+	if (!arena)
+		scr = &tmp;
+	next = arena;
+	i = 0;
+	while (i < 2)
+	{
+		scr->hits[i].x = arena_take(&next, w * sizeof(int));
+		scr->hits[i].y = arena_take(&next, w * sizeof(int));
+		scr->hits[i].dist = arena_take(&next, w * sizeof(t_dist));
+		scr->hits[i].side = arena_take(&next, w);
+		scr->hits[i].exact = arena_take(&next, w);
+		scr->hits[i].valid = 0;
+		scr->columns[i].width = w;
+		scr->columns[i].height = h;
+		scr->columns[i].draw_start = arena_take(&next, w * sizeof(int));
+		scr->columns[i].draw_end = arena_take(&next, w * sizeof(int));
+		scr->columns[i].zbuf = arena_take(&next, w * sizeof(float));
+		scr->columns[i].wallColor = arena_take(&next, w);
+		scr->columns[i].texX = arena_take(&next, w);
+		scr->columns[i].texStart = arena_take(&next, w * sizeof(unsigned int));
+		scr->columns[i].texStep = arena_take(&next, w * sizeof(unsigned int));
+		scr->cells[i] = arena_take(&next, (size_t)w * h);
+		i++;
+	}
+	scr->row_dist = arena_take(&next, h * sizeof(float));
+	scr->row_fog = arena_take(&next, h);
+	scr->frame.data = arena_take(&next, FRAME_BUF_SIZE(w, h, p));
+	if (opts.output_thread)
+	{
+		scr->out_cells[0] = arena_take(&next, (size_t)w * h);
+		scr->out_cells[1] = arena_take(&next, (size_t)w * h);
+		scr->out_data = arena_take(&next, FRAME_BUF_SIZE(w, h, p));
+	}
+	return (next - arena);
+}
+
+// Computes the distance of the floor or ceiling seen by each row, for a camera halfway
+// between them : the farther a row is from the horizon, the closer what it sees.
+// The horizon row itself sees infinitely far, it gets the farthest fog.
+void screen_rows_dist(t_screen *scr)
+{
+	int	y;
+	int	p;
+
+	y = 0;
+	while (y < scr->height)
+	{
+		p = abs(y - scr->height / 2);
+		scr->row_dist[y] = p ? 0.5f * scr->height / p : 1e4f;
+		scr->row_fog[y] = shade_fog[get_shade(scr->row_dist[y]) - PAL_WALL];
+		y++;
+	}
+}
+
+// Hands the grids of a (re)sized screen out to the slots, nothing waiting,
+// and sets up the output thread's view of the screen.
+void output_reset(t_screen *scr)
+{
+	output.slots[0].grid = scr->cells[0];
+	output.slots[1].grid = scr->cells[1];
+	output.slots[2].grid = scr->out_cells[0];
+	output.shown = scr->out_cells[1];
+	output.back = 0;
+	output.ready = 1;
+	output.front = 2;
+	scr->cur = 0;
+	output.view = *scr;
+	output.view.frame.data = scr->out_data;
+	output.view.frame.len = 0;
+	output.view.valid = 0;
+}
+
+// Resizes the screen to w * h pixels of p characters, reallocating the arena only
+// if the size changed. Any frame in flight is dropped and the next frame is a full repaint.
+// Returns 1 if the size changed.
+int screen_resize(t_screen *scr, int w, int h, int p)
+{
+	size_t	size;
+
+	if (scr->arena && w == scr->width && h == scr->height && p == scr->pixel)
+		return (0);
+	if (scr->inflight)
+		pool_wait();
+	// The output thread may be writing a frame out of the arena.
+	if (output.running)
+		pthread_mutex_lock(&output.lock);
+	free(scr->arena);
+	size = screen_layout(scr, NULL, w, h, p);
+	if (posix_memalign((void **)&scr->arena, CACHE_LINE, size) != 0)
+	{
+		perror("screen_resize()");
+		exit(1);
+	}
+	memset(scr->arena, 0, size);
+	screen_layout(scr, scr->arena, w, h, p);
+	scr->width = w;
+	scr->height = h;
+	scr->pixel = p;
+	scr->half = opts.half_block ? 2 : 1;
+	scr->rows = (h + scr->half - 1) / scr->half;
+	screen_rows_dist(scr);
+	scr->frame.len = 0;
+	scr->valid = 0;
+	scr->inflight = 0;
+	scr->front_ready = 0;
+	memset(&scr->inflight_pose, 0, sizeof(scr->inflight_pose));
+	if (output.running)
+	{
+		output_reset(scr);
+		pthread_mutex_unlock(&output.lock);
+	}
+	return (1);
+}
+
+// Gets the resolution to render at : the --size one if given, otherwise one that fills
+// the terminal (keeping the last line free so the final newline doesn't scroll).
+// Pixels are p characters wide, the width shrinks accordingly when the governor widens them.
+// With --half-block, every terminal row holds two rows of pixels.
+void query_size(int *w, int *h, int *p)
+{
+	struct winsize	ws;
+
+	*p = governor.scale * (sizeof(PIXEL_CHAR) - 1);
+	*w = opts.width;
+	*h = opts.height;
+	if (*w && *h)
+	{
+		*w = (*w + governor.scale - 1) / governor.scale;
+		return ;
+	}
+	*w = DEFAULT_WIDTH;
+	*h = DEFAULT_HEIGHT;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col >= *p && ws.ws_row > 1)
+	{
+		*w = ws.ws_col / *p;
+		*h = (ws.ws_row - 1) * (opts.half_block ? 2 : 1);
+	}
+	if (*w > MAX_WIDTH)
+		*w = MAX_WIDTH;
+	if (*h > MAX_HEIGHT)
+		*h = MAX_HEIGHT;
+}
+
+#ifdef STATS
+// Opens the --stats stream : stderr for "-", a Unix socket to connect to, or a file to append to.
+// The stream is non-blocking, lines are dropped rather than slowing the renderer down.
+int stats_open(const char *path)
+{
+	struct sockaddr_un	addr;
+	struct stat			st;
+
+	if (strcmp(path, "-") == 0)
+		stats.fd = STDERR_FILENO;
+	else if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+	{
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+		stats.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (stats.fd >= 0 && connect(stats.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		{
+			close(stats.fd);
+			stats.fd = -1;
+		}
+		if (stats.fd >= 0)
+			fcntl(stats.fd, F_SETFL, fcntl(stats.fd, F_GETFL) | O_NONBLOCK);
+	}
+	else
+		stats.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK, 0644);
+	if (stats.fd < 0)
+	{
+		perror(path);
+		return (-1);
+	}
+	return (0);
+}
+
+// Exports the stats of the frame just composed as one JSON line, and appends the HUD
+// on the line below the frame. The frame time is the one of the previous render(),
+// this one isn't over yet. Bytes and escapes don't count the HUD itself.
+void stats_frame(t_screen *scr, t_columns *cols)
+{
+	char	line[HUD_MAX - CURSOR_ESC_MAX - 8];
+	double	steps;
+	double	cached;
+	double	reused;
+	size_t	bytes;
+	int		escapes;
+	int		n;
+
+	stats.frames++;
+	steps = (double)cols->steps / cols->width;
+	cached = 100.0 * cols->cached / cols->width;
+	reused = 100.0 * cols->reused / cols->width;
+	bytes = scr->frame.len;
+	escapes = scr->frame.escapes;
+	scr->frame.escapes = 0;
+	if (opts.hud)
+	{
+		// Cut to the width of the frame so the line never wraps.
+		n = scr->width * scr->pixel + 1;
+		snprintf(line, n < (int)sizeof(line) ? n : (int)sizeof(line),
+			"frame %.2f ms  cast %.2f ms  %.1f steps/ray  %.0f%% cached  %.0f%% reused  %zu B  %d esc"
+			"  x%d %d fps", cols->frame_ns / 1e6, cols->cast_ns / 1e6, steps, cached, reused,
+			bytes, escapes,
+			governor.scale, governor.fps);
+		if (opts.binary)
+			wire_text(&scr->frame, line);
+		else
+		{
+			frame_append_cursor(&scr->frame, scr->rows, 0);
+			frame_append(&scr->frame, RESET, sizeof(RESET) - 1);
+			frame_append(&scr->frame, line, strlen(line));
+			frame_append(&scr->frame, "\033[K", 3);
+		}
+	}
+	if (stats.fd < 0)
+		return ;
+	n = snprintf(line, sizeof(line), "{\"frame\":%lld,\"frame_us\":%.1f,\"cast_us\":%.1f,"
+		"\"steps_per_ray\":%.2f,\"cached_pct\":%.1f,\"reused_pct\":%.1f,\"bytes\":%zu,"
+		"\"escapes\":%d,\"scale\":%d,\"fps\":%d,\"protocol\":\"%s\",\"dropped\":%lld}\n",
+		stats.frames, cols->frame_ns / 1e3, cols->cast_ns / 1e3, steps, cached, reused, bytes, escapes,
+		governor.scale, governor.fps, opts.binary ? "binary" : "ansi",
+		__atomic_load_n(&output.dropped, __ATOMIC_RELAXED));
+	if (n >= (int)sizeof(line))
+		n = sizeof(line) - 1;
+	if (write(stats.fd, line, n) < 0)
+		return ;
+}
+#endif
+
+// Composes the frame from the cell grid already filled : a full repaint for the first frame
+// (or with --full-redraw), a delta against the previous one otherwise.
+// With --binary, the same in the binary protocol.
+void compose(t_screen *scr)
+{
+	if (opts.binary)
+		compose_binary(scr);
+	else if (opts.full_redraw || !scr->valid)
+	{
+		clear_screen(&scr->frame);
+		compose_frame(scr);
+		scr->valid = 1;
+	}
+	else
+		compose_delta(scr);
+}
+
+// Applies a governor step : resets the measures, the main loop picks up the new settings.
+void governor_changed(void)
+{
+	governor.calm = 0;
+	governor.settle = GOV_SETTLE;
+	governor.drain_ms = 500.0f / governor.fps;
+	governor.changed = 1;
+}
+
+// Feeds the governor with the time it took to get a frame out (ns),
+// and steps quality down when it is too slow for the frame rate, or back up after
+// enough fast frames.
+void governor_sample(long long ns)
+{
+	float	budget;
+
+	if (governor.settle > 0)
+	{
+		governor.settle--;
+		return ;
+	}
+	governor.drain_ms += (ns / 1e6f - governor.drain_ms) * 0.25f;
+	budget = 1000.0f / governor.fps;
+	governor.calm = governor.drain_ms < budget * GOV_FAST ? governor.calm + 1 : 0;
+	if (governor.drain_ms > budget * GOV_SLOW)
+	{
+		if (governor.scale < GOV_MAX_SCALE)
+			governor.scale++;
+		else if (governor.fps / 2 >= GOV_MIN_FPS)
+			governor.fps /= 2;
+		else
+			return ;
+		governor_changed();
+	}
+	else if (governor.calm >= GOV_CALM)
+	{
+		if (governor.fps < opts.fps)
+			governor.fps = governor.fps * 2 < opts.fps ? governor.fps * 2 : opts.fps;
+		else if (governor.scale > 1)
+			governor.scale--;
+		else
+			return ;
+		governor_changed();
+	}
+}
+
+// Composes and writes out the frame waiting in ready. The grid it comes from
+// is then the one shown, and the previous one goes back to the queue in its place.
+void output_frame(void)
+{
+	t_output_slot	*s;
+	t_screen		*v;
+	unsigned char	*grid;
+
+	output.front = __atomic_exchange_n(&output.ready, output.front, __ATOMIC_ACQ_REL) & 3;
+	s = &output.slots[output.front];
+	v = &output.view;
+	v->cells[0] = s->grid;
+	v->cells[1] = output.shown;
+	v->cur = 0;
+	compose(v);
+#ifdef STATS
+	stats_frame(v, &s->cols);
+#endif
+	frame_flush(&v->frame, STDOUT_FILENO);
+	grid = output.shown;
+	output.shown = s->grid;
+	s->grid = grid;
+}
+
+// Output thread : writes out the latest frame every time it is woken up, until output_stop().
+void *output_worker(void *arg)
+{
+	(void)arg;
+	while (1)
+	{
+		while (sem_wait(&output.wake) < 0 && errno == EINTR)
+			;
+		pthread_mutex_lock(&output.lock);
+		if (output.quit)
+			break ;
+		if (__atomic_load_n(&output.ready, __ATOMIC_ACQUIRE) & OUT_FRESH)
+			output_frame();
+		pthread_mutex_unlock(&output.lock);
+	}
+	pthread_mutex_unlock(&output.lock);
+	return (NULL);
+}
+
+// Starts the output thread for scr. Returns -1 if it couldn't be.
+int output_start(t_screen *scr)
+{
+	pthread_mutex_init(&output.lock, NULL);
+	sem_init(&output.wake, 0, 0);
+	output_reset(scr);
+	if (pthread_create(&output.thread, NULL, output_worker, NULL) != 0)
+		return (-1);
+	output.running = 1;
+	return (0);
+}
+
+// Lets the output thread finish the frame it is writing, and stops it.
+// A frame still waiting is dropped.
+void output_stop(void)
+{
+	if (!output.running)
+		return ;
+	pthread_mutex_lock(&output.lock);
+	output.quit = 1;
+	pthread_mutex_unlock(&output.lock);
+	sem_post(&output.wake);
+	pthread_join(output.thread, NULL);
+	output.running = 0;
+}
+
+// Hands the grid just filled in scr->cells[scr->cur] to the output thread, and takes
+// the slot given back in return to fill the next one. A frame that was still waiting
+// is dropped.
+void output_push(t_screen *scr, t_columns *cols)
+{
+	t_output_slot	*s;
+	unsigned		old;
+
+	s = &output.slots[output.back];
+	s->cols = *cols;
+	STAT(s->cols.frame_ns = stats.frame_ns);
+	old = __atomic_exchange_n(&output.ready, output.back | OUT_FRESH, __ATOMIC_ACQ_REL);
+	output.back = old & 3;
+	if (old & OUT_FRESH)
+		__atomic_fetch_add(&output.dropped, 1, __ATOMIC_RELAXED);
+	scr->cells[scr->cur] = output.slots[output.back].grid;
+	sem_post(&output.wake);
+}
+
+// Fills the cell grid from a column set, composes the frame (full or delta)
+// and writes it out at once. Nothing is written when no cell changed.
+// With --governor, the write is timed up to the terminal having drained it.
+void present(t_screen *scr, t_columns *cols)
+{
+	long long	t;
+
+	fill_cells(scr, cols);
+	if (output.running)
+	{
+		output_push(scr, cols);
+		return ;
+	}
+	compose(scr);
+#ifdef STATS
+	cols->frame_ns = stats.frame_ns;
+	stats_frame(scr, cols);
+#endif
+	if (scr->frame.len)
+	{
+		t = now_ns();
+		frame_flush(&scr->frame, STDOUT_FILENO);
+		if (opts.governor)
+		{
+			tcdrain(STDOUT_FILENO);
+			governor_sample(now_ns() - t);
+		}
+	}
+	scr->cur = !scr->cur;
+}
+
+// Waits for the cast in flight, if any, which is then the one to present.
+void render_settle(t_screen *scr)
+{
+	if (!scr->inflight)
+		return ;
+	pool_wait();
+	scr->back = !scr->back;
+	scr->inflight = 0;
+	scr->front_ready = 1;
+}
+
+// The main render loop.
+// For each vertical column on the screen, a ray is cast, DDA is performed,
+// and a wall slice is computed and stored.
+// Then the cell grid is filled with sky, wall, or floor color accordingly,
+// and composed into the frame buffer, either fully or as a delta against the previous
+// frame, and written out at once. Nothing is written when no cell changed.
+// draw_start[x] is top of the wall slice in column x
+// draw_end[x] is bottom of the wall slice in column x
+//
+// With worker threads, casting and presenting are pipelined : the workers cast this
+// frame while the main thread presents the previous one, so the screen is one render behind.
+// Returns 1 when a frame is still in flight, render() must then be called again
+// (with the same pose if nothing moved) to get it on screen.
+int render(t_screen *scr, t_player player)
+{
+	if (!pool.count)
+	{
+		cast_begin(scr, &scr->columns[0], &player);
+		STAT(scr->columns[0].cast_ns = -now_ns());
+		cast_columns(&player, &scr->columns[0], 0, scr->width);
+		STAT(scr->columns[0].cast_ns += now_ns());
+		present(scr, &scr->columns[0]);
+		return (0);
+	}
+	render_settle(scr);
+	if (memcmp(&player, &scr->inflight_pose, sizeof(player)) != 0)
+	{
+		scr->inflight_pose = player;
+		cast_begin(scr, &scr->columns[scr->back], &player);
+		pool_dispatch(&player, &scr->columns[scr->back]);
+		scr->inflight = 1;
+	}
+	// Overlaps with the workers casting the new frame.
+	if (scr->front_ready)
+		present(scr, &scr->columns[!scr->back]);
+	return (scr->inflight);
+}
+
+// Terminal settings saved by terminal_raw(), restored on exit.
+struct termios	saved_termios;
+int				raw_mode;
+
+// Restores the terminal as it was at startup. Safe to call more than once.
+void terminal_restore(void)
+{
+	if (!raw_mode)
+		return ;
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_termios);
+	if (write(STDOUT_FILENO, RESET SHOW_CURSOR "\n", sizeof(RESET SHOW_CURSOR "\n") - 1) < 0)
+		return ;
+	raw_mode = 0;
+}
+
+// Set by SIGWINCH, the main loop then picks up the new terminal size.
+volatile sig_atomic_t	winched;
+
+void on_winch(int sig)
+{
+	(void)sig;
+	winched = 1;
+}
+
+// Restores the terminal before dying from SIGINT/SIGTERM/SIGHUP.
+void on_fatal_signal(int sig)
+{
+	terminal_restore();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+// Puts the terminal in raw mode once for the whole session :
+// no line buffering, no echo, and read() returns as soon as one byte is available.
+// Does nothing when stdin is not a terminal (piped input).
+void terminal_raw(void)
+{
+	struct termios	raw;
+
+	if (tcgetattr(STDIN_FILENO, &saved_termios) < 0)
+		return ;
+	raw = saved_termios;
+	raw.c_lflag &= ~(ICANON | ECHO);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) < 0)
+		return ;
+	raw_mode = 1;
+	atexit(terminal_restore);
+	signal(SIGINT, on_fatal_signal);
+	signal(SIGTERM, on_fatal_signal);
+	signal(SIGHUP, on_fatal_signal);
+	signal(SIGWINCH, on_winch);
+	if (write(STDOUT_FILENO, HIDE_CURSOR, sizeof(HIDE_CURSOR) - 1) < 0)
+		return ;
+}
+
+// Maps a key byte to its t_input slot, -1 for keys we don't use.
+int key_slot(char key)
+{
+	if (key == 'w')
+		return (KEY_FORWARD);
+	if (key == 's')
+		return (KEY_BACKWARD);
+	if (key == 'a')
+		return (KEY_LEFT);
+	if (key == 'd')
+		return (KEY_RIGHT);
+	if (key == 'e')
+		return (KEY_ROT_LEFT);
+	if (key == 'q')
+		return (KEY_ROT_RIGHT);
+	return (-1);
+}
+
+// Records one key byte received at time now (ms).
+// A byte for a key that is not currently held starts a new press.
+void input_feed(t_input *in, char key, long long now)
+{
+	int	k;
+
+	if (key == 27)
+		in->quit = 1;
+	// Only a new press uses a door, not the repeats of a held space.
+	if (key == ' ' && now >= in->last_use + KEY_RELEASE_MS)
+		in->use = 1;
+	if (key == ' ')
+		in->last_use = now;
+	k = key_slot(key);
+	if (k < 0)
+		return ;
+	if (now >= in->last_seen[k] + KEY_RELEASE_MS)
+		in->pressed_at[k] = now;
+	in->last_seen[k] = now;
+}
+
+// Starts recording key bytes to path, with times counted from now (ms).
+int record_open(const char *path, long long now)
+{
+	recorder.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (recorder.fd < 0 || write(recorder.fd, REC_MAGIC, sizeof(REC_MAGIC) - 1) < 0)
+	{
+		perror(path);
+		return (-1);
+	}
+	recorder.last = now;
+	return (0);
+}
+
+// Adds one key byte received at time now (ms) to the recording buffer.
+void record_key(char key, long long now)
+{
+	unsigned long long	delta;
+
+	delta = now > recorder.last ? now - recorder.last : 0;
+	recorder.last = now;
+	while (delta >= 0x80)
+	{
+		recorder.buf[recorder.len++] = (delta & 0x7f) | 0x80;
+		delta >>= 7;
+	}
+	recorder.buf[recorder.len++] = delta;
+	recorder.buf[recorder.len++] = key;
+}
+
+// Writes the buffered records out.
+void record_flush(void)
+{
+	size_t	done;
+	ssize_t	n;
+
+	done = 0;
+	while (recorder.fd >= 0 && done < recorder.len)
+	{
+		n = write(recorder.fd, recorder.buf + done, recorder.len - done);
+		if (n < 0 && errno == EINTR)
+			continue ;
+		if (n <= 0)
+			break ;
+		done += n;
+	}
+	recorder.len = 0;
+}
+
+// Decodes the time of the next record into replay.at, or sets done at the end of the log.
+// A truncated last record is ignored.
+void replay_advance(void)
+{
+	unsigned long long	delta;
+	int					shift;
+
+	delta = 0;
+	shift = 0;
+	while (replay.pos < replay.size && shift < 64)
+	{
+		delta |= (unsigned long long)(replay.data[replay.pos] & 0x7f) << shift;
+		shift += 7;
+		if (!(replay.data[replay.pos++] & 0x80))
+			break ;
+	}
+	if (replay.pos >= replay.size || (replay.data[replay.pos - 1] & 0x80))
+	{
+		replay.done = 1;
+		return ;
+	}
+	replay.at += delta;
+}
+
+// Loads a recording to replay. Returns -1 if it can't be read or isn't one.
+int replay_open(const char *path)
+{
+	struct stat	st;
+	int			fd;
+	ssize_t		n;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		perror(path);
+		return (-1);
+	}
+	replay.size = st.st_size;
+	replay.data = malloc(replay.size + 1);
+	n = replay.data ? read(fd, replay.data, replay.size) : -1;
+	close(fd);
+	if (n != (ssize_t)replay.size || replay.size < sizeof(REC_MAGIC) - 1
+		|| memcmp(replay.data, REC_MAGIC, sizeof(REC_MAGIC) - 1) != 0)
+	{
+		fprintf(stderr, "%s: not an input recording\n", path);
+		return (-1);
+	}
+	replay.pos = sizeof(REC_MAGIC) - 1;
+	replay_advance();
+	return (0);
+}
+
+// Feeds every recorded key due by time upto (ms since the recording started)
+// through input_feed(), as if it had been received at base + its time.
+// Returns the number of keys fed.
+int replay_feed(t_input *in, long long upto, long long base)
+{
+	int	n;
+
+	n = 0;
+	while (!replay.done && replay.at <= upto)
+	{
+		input_feed(in, replay.data[replay.pos++], base + replay.at);
+		replay_advance();
+		n++;
+	}
+	return (n);
+}
+
+// Length of the whole recording in ms, walking it from the start.
+long long replay_length(void)
+{
+	t_replay	saved;
+	long long	end;
+
+	saved = replay;
+	end = 0;
+	while (!replay.done)
+	{
+		end = replay.at;
+		replay.pos++;
+		replay_advance();
+	}
+	replay = saved;
+	return (end);
+}
+
+// Reads every byte pending on fd into the input state.
+// Returns the number of bytes read, sets quit on end of input.
+int input_drain(t_input *in, int fd)
+{
+	char			buf[256];
+	struct pollfd	pfd;
+	long long		now;
+	int				total;
+	int				n;
+	int				i;
+
+	total = 0;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	now = now_ms();
+	do
+	{
+		n = read(fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue ;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break ;
+		if (n <= 0)
+		{
+			in->quit = 1;
+			break ;
+		}
+		i = 0;
+		while (i < n)
+		{
+			if (recorder.fd >= 0)
+				record_key(buf[i], now);
+			input_feed(in, buf[i++], now);
+		}
+		record_flush();
+		total += n;
+	}
+	while (n == sizeof(buf) && poll(&pfd, 1, 0) > 0);
+	return (total);
+}
+
+// Returns 1 while a key is still held at time t (ms), or was released after t,
+// i.e. while part of its press hasn't been simulated yet.
+int input_active(t_input *in, long long t)
+{
+	int	k;
+
+	k = 0;
+	while (k < KEY_COUNT)
+	{
+		if (in->last_seen[k] && in->last_seen[k] + KEY_RELEASE_MS > t)
+			return (1);
+		k++;
+	}
+	return (0);
+}
+
+// Computes held[] for the frame covering [from, to] (ms) :
+// the overlap of that interval with every key's press.
+void input_frame(t_input *in, long long from, long long to)
+{
+	long long	start;
+	long long	end;
+	int			k;
+
+	k = 0;
+	while (k < KEY_COUNT)
+	{
+		start = in->pressed_at[k] > from ? in->pressed_at[k] : from;
+		end = in->last_seen[k] + KEY_RELEASE_MS;
+		if (end > to)
+			end = to;
+		in->held[k] = 0;
+		if (in->last_seen[k] && end > start)
+			in->held[k] = (end - start) / 1000.0f;
+		k++;
+	}
+}
+
+// Changes the cell at (x, y) to value c, updating what was built from the cells in place :
+// its bit in both solidity grids, its block's wall count and its pixel in the minimap window.
+// Nothing else is rebuilt, so opening a door in a huge map costs no more than in a small one.
+// Rays must not be cast meanwhile.
+void map_set_cell(int x, int y, uint8_t c)
+{
+	size_t	i;
+	int		delta;
+
+	i = (size_t)y * map.width + x;
+	delta = cell_value_solid(c) - cell_value_solid(map.cells[i]);
+	map.cells[i] = c;
+	if (delta)
+	{
+		map.solid[(size_t)y * map.solid_stride + (x >> 6)] ^= 1ULL << (x & 63);
+		map.solid_t[(size_t)x * map.solid_t_stride + (y >> 6)] ^= 1ULL << (y & 63);
+		map.blocks[(size_t)(y >> BLOCK_SHIFT) * map.blocks_stride + (x >> BLOCK_SHIFT)] += delta;
+	}
+	// The marker's cell is drawn again when the marker leaves it.
+	if (minimap.ox >= 0 && x >= minimap.ox && x < minimap.ox + minimap.vw && y >= minimap.oy
+		&& y < minimap.oy + minimap.vh && (x != minimap.px || y != minimap.py))
+		minimap.view[(y - minimap.oy + 1) * (minimap.vw + 2) + x - minimap.ox + 1] = minimap_pixel(i);
+}
+
+// Opens or closes the door in front of player p, if there is one within DOOR_REACH.
+// A door isn't closed on a player standing in it.
+// Returns 1 with the door's cell in *x and *y if one was used.
+int door_use(t_player *p, int *x, int *y)
+{
+	uint8_t	c;
+	int		i;
+
+	*x = (int)(p->x + p->dirX * DOOR_REACH);
+	*y = (int)(p->y + p->dirY * DOOR_REACH);
+	if (*x < 0 || *y < 0 || *x >= map.width || *y >= map.height)
+		return (0);
+	c = map.cells[(size_t)*y * map.width + *x];
+	if (c != CELL_DOOR && c != CELL_DOOR_OPEN)
+		return (0);
+	if (c == CELL_DOOR_OPEN && (*x == (int)p->x && *y == (int)p->y))
+		return (0);
+	i = 0;
+	while (c == CELL_DOOR_OPEN && i < sprites.peer_count)
+	{
+		if ((int)sprites.peers[i].x == *x && (int)sprites.peers[i].y == *y)
+			return (0);
+		i++;
+	}
+	map_set_cell(*x, *y, c == CELL_DOOR ? CELL_DOOR_OPEN : CELL_DOOR);
+	return (1);
+}
+
+// Clips the range [*t0, *t1] of a segment from o, moving by d along an axis,
+// to where it is within the slab [c, c + 1] of that axis.
+static inline void clip_slab(float o, float d, int c, float *t0, float *t1)
+{
+	float	a, b;
+
+	if (!d)
+	{
+		if (o < c || o > c + 1)
+			*t0 = *t1 + 1;
+		return ;
+	}
+	a = (c - o) / d;
+	b = (c + 1 - o) / d;
+	*t0 = fmaxf(*t0, fminf(a, b));
+	*t1 = fminf(*t1, fmaxf(a, b));
+}
+
+// Forgets the hits of a cast whose rays went through, or ended on, the cell (cx, cy),
+// so a changed cell is never taken from them as it was : they aren't exact anymore,
+// which keeps --turn-reuse from reusing them. The others still are, and coherent_hit()
+// checks the cells themselves, so it doesn't need to know.
+void hits_invalidate(t_hits *h, int width, int cx, int cy)
+{
+	float	dx, dy;
+	float	t0, t1;
+	float	d;
+	int		x;
+
+	x = 0;
+	while (h->valid && x < width)
+	{
+#ifdef FIXED_DDA
+		d = (float)h->dist[x] / FIX_ONE;
+#else
+		d = h->dist[x];
+#endif
+		// The ray from the pose to its hit, clipped to the cell's slabs.
+		dx = (h->pose.dirX + h->pose.planeX * (2 * x / (float)width - 1)) * d;
+		dy = (h->pose.dirY + h->pose.planeY * (2 * x / (float)width - 1)) * d;
+		t0 = 0;
+		t1 = 1;
+		clip_slab(h->pose.x, dx, cx, &t0, &t1);
+		clip_slab(h->pose.y, dy, cy, &t0, &t1);
+		if (t0 <= t1 + 1e-4f || (h->x[x] == cx && h->y[x] == cy))
+			h->exact[x] = 0;
+		x++;
+	}
+}
+
+// A cell of the map changed : stale hits of the screen's casts are forgotten, and the next
+// render() casts again even if the player didn't move.
+void screen_map_changed(t_screen *scr, int cx, int cy)
+{
+	hits_invalidate(&scr->hits[0], scr->width, cx, cy);
+	hits_invalidate(&scr->hits[1], scr->width, cx, cy);
+	scr->inflight_pose.x = -1;
+}
+
+// Forgets what the screen shows and the hits of its last casts, so the next frame
+// is cast and composed from scratch.
+void screen_reset(t_screen *scr)
+{
+	scr->valid = 0;
+	scr->hits[0].valid = 0;
+	scr->hits[1].valid = 0;
+}
+
+// Uses the door in front of the player when space was pressed, once the screen's cast
+// in flight is done with the map. Returns 1 if a door was used.
+int player_use(t_screen *scr, t_player *p, t_input *in)
+{
+	int	x, y;
+
+	if (!in->use)
+		return (0);
+	in->use = 0;
+	render_settle(scr);
+	if (!door_use(p, &x, &y))
+		return (0);
+	screen_map_changed(scr, x, y);
+	return (1);
+}
+
+//moves the player.
+// Applies one frame of input : every held key moves or rotates the player
+// proportionally to how long it was held during the frame.
+void move_player(t_player *p, t_input *in)
+{
+	float moveSpeed;
+	float rotSpeed;
+	float newX;
+	float newY;
+	float oldDirX;
+	float oldPlaneX;
+
+	if (in->held[KEY_FORWARD] > 0) //move forward
+	{
+		moveSpeed = MOVE_SPEED * in->held[KEY_FORWARD];
+		newX = p->x + p->dirX * moveSpeed;
+		newY = p->y + p->dirY * moveSpeed;
+		if (!map_solid((int)p->x, (int)newY)) p->y = newY;
+		if (!map_solid((int)newX, (int)p->y)) p->x = newX;
+	}
+	if (in->held[KEY_BACKWARD] > 0) // move backward
+	{
+		moveSpeed = MOVE_SPEED * in->held[KEY_BACKWARD];
+		newX = p->x - p->dirX * moveSpeed;
+		newY = p->y - p->dirY * moveSpeed;
+		if (!map_solid((int)p->x, (int)newY)) p->y = newY;
+		if (!map_solid((int)newX, (int)p->y)) p->x = newX;
+	}
+	if (in->held[KEY_LEFT] > 0) // strafe left
+	{
+		moveSpeed = MOVE_SPEED * in->held[KEY_LEFT];
+		newX = p->x - p->planeX * moveSpeed;
+		newY = p->y - p->planeY * moveSpeed;
+		if (!map_solid((int)p->x, (int)newY)) p->y = newY;
+		if (!map_solid((int)newX, (int)p->y)) p->x = newX;
+	}
+	if (in->held[KEY_RIGHT] > 0) // strafe right
+	{
+		moveSpeed = MOVE_SPEED * in->held[KEY_RIGHT];
+		newX = p->x + p->planeX * moveSpeed;
+		newY = p->y + p->planeY * moveSpeed;
+		if (!map_solid((int)p->x, (int)newY)) p->y = newY;
+		if (!map_solid((int)newX, (int)p->y)) p->x = newX;
+	}
+	if (in->held[KEY_ROT_LEFT] > 0) // rotate left
+	{
+		rotSpeed = ROT_SPEED * in->held[KEY_ROT_LEFT];
+		oldDirX = p->dirX;
+		p->dirX = p->dirX * cos(rotSpeed) - p->dirY * sin(rotSpeed);
+		p->dirY = oldDirX * sin(rotSpeed) + p->dirY * cos(rotSpeed);
+		oldPlaneX = p->planeX;
+		p->planeX = p->planeX * cos(rotSpeed) - p->planeY * sin(rotSpeed);
+		p->planeY = oldPlaneX * sin(rotSpeed) + p->planeY * cos(rotSpeed);
+	}
+	if (in->held[KEY_ROT_RIGHT] > 0) // rotate right
+	{
+		rotSpeed = ROT_SPEED * in->held[KEY_ROT_RIGHT];
+		oldDirX = p->dirX;
+		p->dirX = p->dirX * cos(-rotSpeed) - p->dirY * sin(-rotSpeed);
+		p->dirY = oldDirX * sin(-rotSpeed) + p->dirY * cos(-rotSpeed);
+		oldPlaneX = p->planeX;
+		p->planeX = p->planeX * cos(-rotSpeed) - p->planeY * sin(-rotSpeed);
+		p->planeY = oldPlaneX * sin(-rotSpeed) + p->planeY * cos(-rotSpeed);
+	}
+}
+
+// Per-frame measures of the benchmark, one array per stage.
+enum { STAGE_CAST, STAGE_FILL, STAGE_COMPOSE, STAGE_FRAME, STAGE_BYTES, STAGE_STEPS, STAGE_COUNT };
+
+const char	*stage_names[STAGE_COUNT] = {
+	"cast (us)", "fill (us)", "compose (us)", "frame (us)", "bytes", "steps/ray"
+};
+
+int cmp_ll(const void *a, const void *b)
+{
+	long long	x;
+	long long	y;
+
+	x = *(const long long *)a;
+	y = *(const long long *)b;
+	return ((x > y) - (x < y));
+}
+
+// Sorts a stage's samples and prints its min, median, 99th percentile and mean.
+// Times are sampled in ns and printed in us.
+void bench_report(const char *name, long long *v, int n, int scale)
+{
+	long long	total;
+	int			i;
+
+	qsort(v, n, sizeof(*v), cmp_ll);
+	total = 0;
+	i = 0;
+	while (i < n)
+		total += v[i++];
+	printf("%-14s %10.1f %10.1f %10.1f %10.1f\n", name, (double)v[0] / scale,
+		(double)v[n / 2] / scale, (double)v[(n - 1) * 99 / 100] / scale,
+		(double)total / n / scale);
+}
+
+// Sets held[] for benchmark frame i, which covers [i, i + 1) / fps seconds :
+// the key of the current beat of the camera path held for the whole frame,
+// or the keys of the recording replayed with --replay, on a virtual clock.
+void bench_input(t_input *in, int i)
+{
+	long long	from;
+	long long	to;
+	int			k;
+
+	from = (long long)i * 1000 / opts.fps;
+	to = (long long)(i + 1) * 1000 / opts.fps;
+	if (replay.data)
+	{
+		// Shifted by 1 s, a key last seen at time 0 would count as never pressed.
+		replay_feed(in, to, 1000);
+		input_frame(in, 1000 + from, 1000 + to);
+		return ;
+	}
+	memset(in->held, 0, sizeof(in->held));
+	k = key_slot(opts.bench_path[from / BENCH_BEAT_MS % strlen(opts.bench_path)]);
+	if (k >= 0)
+		in->held[k] = 1.0f / opts.fps;
+}
+
+// Renders benchmark frame i into the frame buffer : the input of the frame, then the cast
+// (waited for on the workers), the cell grid and the frame, t[] getting the time
+// before the cast and after each of those three.
+void bench_frame(t_screen *scr, t_player *player, t_input *input, int i, long long *t)
+{
+	bench_input(input, i);
+	move_player(player, input);
+	player_use(scr, player, input);
+	cast_begin(scr, &scr->columns[0], player);
+	t[0] = now_ns();
+	if (pool.count)
+	{
+		pool_dispatch(player, &scr->columns[0]);
+		pool_wait();
+	}
+	else
+		cast_columns(player, &scr->columns[0], 0, scr->width);
+	t[1] = now_ns();
+	fill_cells(scr, &scr->columns[0]);
+	t[2] = now_ns();
+	compose(scr);
+	t[3] = now_ns();
+}
+
+// Hashes of what a caster rendered : of the wall columns it cast (where each one's slice
+// starts and ends, its shade and texture column) and of the bytes composed from them.
+typedef struct {
+	uint64_t	columns;
+	uint64_t	bytes;
+} t_digest;
+
+// FNV-1a of n bytes at p, carrying on from h.
+uint64_t fnv1a(uint64_t h, const void *p, size_t n)
+{
+	const unsigned char	*c;
+
+	c = p;
+	while (n--)
+		h = (h ^ *c++) * 1099511628211ULL;
+	return (h);
+}
+
+// Adds the columns and the frame just composed on scr to d.
+void digest_frame(t_digest *d, t_screen *scr, t_columns *cols)
+{
+	d->columns = fnv1a(d->columns, cols->draw_start, cols->width * sizeof(int));
+	d->columns = fnv1a(d->columns, cols->draw_end, cols->width * sizeof(int));
+	d->columns = fnv1a(d->columns, cols->wallColor, cols->width);
+	if (opts.textures)
+		d->columns = fnv1a(d->columns, cols->texX, cols->width);
+	d->bytes = fnv1a(d->bytes, scr->frame.data, scr->frame.len);
+}
+
+// Renders frame i of pose p again on ref with the reference caster (see cast_reference()),
+// and checks the frame just composed on scr against it : the same wall columns, and the
+// same bytes. Both are added to their digest, d[0] for scr and d[1] for ref.
+// Prints where they differ and returns -1 if they do.
+int verify_frame(t_screen *scr, t_screen *ref, t_player *p, int i, t_digest *d)
+{
+	t_columns	*a;
+	t_columns	*b;
+	int			same;
+	int			x;
+
+	a = &scr->columns[0];
+	b = &ref->columns[0];
+	cast_begin(ref, b, p);
+	cast_reference(p, b);
+	fill_cells(ref, b);
+	compose(ref);
+	digest_frame(&d[0], scr, a);
+	digest_frame(&d[1], ref, b);
+	x = 0;
+	while (x < a->width && a->draw_start[x] == b->draw_start[x] && a->draw_end[x] == b->draw_end[x]
+		&& a->wallColor[x] == b->wallColor[x] && (!opts.textures || a->texX[x] == b->texX[x]))
+		x++;
+	if (x < a->width)
+		fprintf(stderr, "frame %d at (%.3f, %.3f) : column %d is rows %d to %d, shade %d,"
+			" texture column %d, the reference caster's rows %d to %d, shade %d,"
+			" texture column %d\n", i, p->x, p->y, x, a->draw_start[x], a->draw_end[x],
+			a->wallColor[x], a->texX[x], b->draw_start[x], b->draw_end[x], b->wallColor[x],
+			b->texX[x]);
+	else if (scr->frame.len != ref->frame.len
+		|| memcmp(scr->frame.data, ref->frame.data, scr->frame.len) != 0)
+		fprintf(stderr, "frame %d at (%.3f, %.3f) : the same walls, but composed in %zu bytes"
+			" that aren't the reference's %zu\n", i, p->x, p->y, scr->frame.len, ref->frame.len);
+	same = x == a->width && scr->frame.len == ref->frame.len
+		&& memcmp(scr->frame.data, ref->frame.data, scr->frame.len) == 0;
+	ref->frame.len = 0;
+	ref->cur = !ref->cur;
+	return (same ? 0 : -1);
+}
+
+// Picks caster k of the ones --verify tries, returns its name,
+// or NULL if this build or CPU doesn't have it.
+const char *verify_caster(int k)
+{
+#if defined(FIXED_DDA)
+	return (k == 0 ? "fixed-point" : NULL);
+#elif defined(RAY_PACKET)
+	opts.scalar = k == 0;
+	packet_lanes = k == 1 ? PACKET_WIDTH : 8;
+	if (k == 0)
+		return ("scalar");
+	if (k == 1)
+		return (PACKET_WIDTH == 8 ? "8 lane packet" : "4 lane packet");
+# ifdef PACKET_DISPATCH
+	if (k == 2 && __builtin_cpu_supports("avx2"))
+		return ("8 lane packet");
+# endif
+	return (NULL);
+#else
+	return (k == 0 ? "scalar" : NULL);
+#endif
+}
+
+// The reference file of --save-ref and --check-ref, open during --verify.
+typedef struct {
+	FILE		*file;
+	int			*buf;		// A frame's columns read back
+	long long	columns;	// Columns checked
+	long long	off;		// and the ones that were not exactly the reference's
+} t_ref_file;
+
+t_ref_file	ref_file;
+
+// Opens opts.ref_path for frames of cols' resolution : writes its header with --save-ref,
+// checks it with --check-ref. Returns -1 on error.
+int ref_open(t_columns *cols)
+{
+	char	magic[8];
+	int		size[2];
+
+	ref_file.file = fopen(opts.ref_path, opts.ref_save ? "wb" : "rb");
+	if (!ref_file.file)
+		return (perror(opts.ref_path), -1);
+	if (opts.ref_save)
+		return (fwrite(REF_MAGIC, 8, 1, ref_file.file) == 1
+			&& fwrite(&cols->width, sizeof(int), 1, ref_file.file) == 1
+			&& fwrite(&cols->height, sizeof(int), 1, ref_file.file) == 1 ? 0
+			: (perror(opts.ref_path), -1));
+	if (fread(magic, 8, 1, ref_file.file) != 1 || memcmp(magic, REF_MAGIC, 8) != 0
+		|| fread(size, sizeof(size), 1, ref_file.file) != 1)
+		return (fprintf(stderr, "%s: not a reference file\n", opts.ref_path), -1);
+	if (size[0] != cols->width || size[1] != cols->height)
+		return (fprintf(stderr, "%s: saved at %dx%d, not %dx%d\n", opts.ref_path,
+			size[0], size[1], cols->width, cols->height), -1);
+	ref_file.buf = malloc(cols->width * (2 * sizeof(int) + 2));
+	if (!ref_file.buf)
+		return (perror("ref_open()"), -1);
+	return (0);
+}
+
+// Whether a and b are at most REF_TOLERANCE apart, in a cycle of n values if n is not 0.
+static int ref_near(int a, int b, int n)
+{
+	int	d;
+
+	d = a > b ? a - b : b - a;
+	if (n && d > n / 2)
+		d = n - d;
+	return (d <= REF_TOLERANCE);
+}
+
+// Writes the reference columns of frame i of pose p to the reference file, or checks them
+// against the ones saved for it : each rounds a slice end, shade or texture column
+// the other way now and then where the two builds' arithmetic differ (see FIXED_DDA),
+// which is tolerated up to REF_TOLERANCE, a door's texture column only on a door.
+// Prints the first column too far and returns -1 when there is one.
+int ref_frame(t_columns *cols, t_player *p, int i)
+{
+	unsigned char	*color;
+	unsigned char	*tex;
+	int				*end;
+	int				w;
+	int				x;
+
+	w = cols->width;
+	if (opts.ref_save)
+		return (fwrite(cols->draw_start, sizeof(int), w, ref_file.file) == (size_t)w
+			&& fwrite(cols->draw_end, sizeof(int), w, ref_file.file) == (size_t)w
+			&& fwrite(cols->wallColor, 1, w, ref_file.file) == (size_t)w
+			&& fwrite(cols->texX, 1, w, ref_file.file) == (size_t)w ? 0
+			: (perror(opts.ref_path), -1));
+	end = ref_file.buf + w;
+	color = (unsigned char *)(end + w);
+	tex = color + w;
+	if (fread(ref_file.buf, 2 * sizeof(int) + 2, w, ref_file.file) != (size_t)w)
+		return (fprintf(stderr, "%s: no frame %d\n", opts.ref_path, i), -1);
+	x = 0;
+	while (x < w)
+	{
+		if (!ref_near(cols->draw_start[x], ref_file.buf[x], 0)
+			|| !ref_near(cols->draw_end[x], end[x], 0)
+			|| !ref_near(cols->wallColor[x], color[x], 0)
+			|| (opts.textures && (cols->texX[x] / TEX_SIZE != tex[x] / TEX_SIZE
+			|| !ref_near(cols->texX[x] % TEX_SIZE, tex[x] % TEX_SIZE, TEX_SIZE))))
+			return (fprintf(stderr, "frame %d at (%.3f, %.3f) : column %d is rows %d to %d,"
+				" shade %d, texture column %d, the saved reference's rows %d to %d, shade %d,"
+				" texture column %d\n", i, p->x, p->y, x, cols->draw_start[x], cols->draw_end[x],
+				cols->wallColor[x], cols->texX[x], ref_file.buf[x], end[x], color[x], tex[x]), -1);
+		ref_file.off += cols->draw_start[x] != ref_file.buf[x] || cols->draw_end[x] != end[x]
+			|| cols->wallColor[x] != color[x] || (opts.textures && cols->texX[x] != tex[x]);
+		x++;
+	}
+	ref_file.columns += w;
+	return (0);
+}
+
+// Closes the reference file once the first run of --verify stopped after frames frames.
+// When checking, prints how many columns were not exactly the saved ones, and returns -1
+// if that is more than REF_OFF_MAX per thousand, or the file has more frames than that.
+// Also returns -1 if the run stopped early, saying so is left to what stopped it.
+int ref_close(int frames)
+{
+	int	extra;
+
+	extra = !opts.ref_save && fgetc(ref_file.file) != EOF;
+	if (fclose(ref_file.file) != 0)
+		return (perror(opts.ref_path), -1);
+	free(ref_file.buf);
+	if (frames < opts.bench)
+		return (-1);
+	if (opts.ref_save)
+		return (printf("reference columns of %d frames saved to %s\n", frames, opts.ref_path), 0);
+	if (extra)
+		return (fprintf(stderr, "%s: saved for more than %d frames\n", opts.ref_path, frames), -1);
+	printf("reference columns of %d frames within %d of %s, %lld of %lld columns off\n",
+		frames, REF_TOLERANCE, opts.ref_path, ref_file.off, ref_file.columns);
+	if (ref_file.off * 1000 > ref_file.columns * REF_OFF_MAX)
+		return (fprintf(stderr, "%s: more than %d columns per thousand off\n", opts.ref_path,
+			REF_OFF_MAX), -1);
+	return (0);
+}
+
+// --verify : renders the benchmark's frames with every caster in turn, with and without
+// the cache and block skipping (on the workers with --threads), checking each frame
+// against the reference caster. --turn-reuse is left out, it is approximate on purpose.
+// Prints the digests of every run, so that builds can be compared too.
+// With --save-ref or --check-ref, the first run also saves the reference caster's columns,
+// or checks them against the ones another build saved (see ref_frame()).
+// Returns the number of runs that differed from the reference.
+int verify_run(t_screen *scr, t_screen *ref, t_player *player)
+{
+	t_player	start;
+	t_input		input;
+	t_digest	d[2];
+	long long	t[4];
+	const char	*name;
+	int			failed;
+	int			ref_frames;
+	int			run;
+	int			i;
+
+	screen_resize(ref, scr->width, scr->height, scr->pixel);
+	if (opts.ref_path && ref_open(&ref->columns[0]) < 0)
+		return (1);
+	start = *player;
+	opts.turn_reuse = 0;
+	printf("%d frames at %dx%d, %d threads\n", opts.bench, scr->width, scr->height, pool.count);
+	failed = 0;
+	ref_frames = 0;
+	run = 0;
+	while (run < 3 * 4)
+	{
+		name = verify_caster(run / 4);
+		opts.no_cache = run & 1;
+		opts.no_skip = run >> 1 & 1;
+		if (name)
+		{
+			*player = start;
+			memset(&input, 0, sizeof(input));
+			memset(d, 0, sizeof(d));
+			screen_reset(scr);
+			screen_reset(ref);
+			i = 0;
+			while (i < opts.bench)
+			{
+				bench_frame(scr, player, &input, i, t);
+				if (verify_frame(scr, ref, player, i, d) < 0
+					|| (opts.ref_path && run == 0 && ref_frame(&ref->columns[0], player, i) < 0))
+					break ;
+				scr->frame.len = 0;
+				scr->cur = !scr->cur;
+				i++;
+			}
+			scr->frame.len = 0;
+			failed += i < opts.bench;
+			ref_frames = run == 0 ? i : ref_frames;
+			printf("%-14s %-9s %-8s columns %016llx bytes %016llx  %s\n", name,
+				opts.no_cache ? "no cache" : "cache", opts.no_skip ? "no skip" : "skip",
+				(unsigned long long)d[0].columns, (unsigned long long)d[0].bytes,
+				i < opts.bench ? "DIFFERENT" : "ok");
+		}
+		run++;
+	}
+	if (failed)
+		fprintf(stderr, "verify: %d runs differ from the reference caster\n", failed);
+	if (opts.ref_path && ref_close(ref_frames) < 0)
+		failed++;
+	return (failed);
+}
+
+// Headless benchmark : renders opts.bench frames along the camera path into the frame buffer,
+// which is then dropped instead of written, and reports per-stage timings.
+// Every frame simulates 1 / fps seconds of input through move_player() like a live session.
+// With --replay, the recording is played as fast as possible instead of the camera path,
+// for as many frames as it lasts. Casting is not pipelined here (the workers are
+// waited for) so each stage is measured on its own. Wall slices are computed while casting,
+// so their cost is part of the cast stage.
+// Every frame is then checked against the reference caster on ref, out of the timings,
+// and the benchmark fails at the first one that differs (see verify_frame()).
+// Except with --turn-reuse, which is approximate on purpose.
+// Returns -1 if a frame differed.
+int bench_run(t_screen *scr, t_screen *ref, t_player *player)
+{
+	t_input		input;
+	t_digest	d[2];
+	long long	*samples[STAGE_COUNT];
+	long long	t[4];
+	int			i;
+	const char	*kind;
+
+	if (replay.data)
+		opts.bench = (replay_length() + KEY_RELEASE_MS) * opts.fps / 1000 + 1;
+	i = 0;
+	while (i < STAGE_COUNT)
+	{
+		samples[i] = malloc(opts.bench * sizeof(long long));
+		if (!samples[i++])
+		{
+			perror("bench_run()");
+			exit(1);
+		}
+	}
+	screen_resize(ref, scr->width, scr->height, scr->pixel);
+	memset(&input, 0, sizeof(input));
+	memset(d, 0, sizeof(d));
+	i = 0;
+	while (i < opts.bench)
+	{
+		bench_frame(scr, player, &input, i, t);
+		samples[STAGE_CAST][i] = t[1] - t[0];
+		samples[STAGE_FILL][i] = t[2] - t[1];
+		samples[STAGE_COMPOSE][i] = t[3] - t[2];
+		samples[STAGE_FRAME][i] = t[3] - t[0];
+		samples[STAGE_BYTES][i] = scr->frame.len;
+		samples[STAGE_STEPS][i] = scr->columns[0].steps * 1000 / scr->width;
+		if (!opts.turn_reuse && verify_frame(scr, ref, player, i, d) < 0)
+		{
+			fprintf(stderr, "bench: frame %d differs from the reference caster,"
+				" timings not reported\n", i);
+			i = STAGE_COUNT;
+			while (i--)
+				free(samples[i]);
+			return (-1);
+		}
+#ifdef STATS
+		scr->columns[0].frame_ns = t[3] - t[0];
+		scr->columns[0].cast_ns = t[1] - t[0];
+		stats_frame(scr, &scr->columns[0]);
+#endif
+		scr->frame.len = 0;
+		scr->cur = !scr->cur;
+		i++;
+	}
+#if defined(FIXED_DDA)
+	kind = "fixed-point";
+#elif defined(RAY_PACKET)
+	kind = opts.scalar ? "scalar" : packet_lanes == 8 ? "8 lane packet" : "4 lane packet";
+#else
+	kind = "scalar";
+#endif
+	printf("%d frames at %dx%d, %d threads, %s rays\n", opts.bench, scr->width, scr->height,
+		pool.count, kind);
+	printf("%-14s %10s %10s %10s %10s\n", "stage", "min", "median", "p99", "mean");
+	i = 0;
+	while (i < STAGE_COUNT)
+	{
+		bench_report(stage_names[i], samples[i], opts.bench, i == STAGE_BYTES ? 1 : 1000);
+		free(samples[i++]);
+	}
+	if (opts.turn_reuse)
+		printf("not checked against the reference caster, --turn-reuse is approximate\n");
+	else
+		printf("same frames as the reference caster, columns %016llx bytes %016llx\n",
+			(unsigned long long)d[0].columns, (unsigned long long)d[0].bytes);
+	return (0);
+}
+
+// A client of the server : its own player, input and screen, everything else is shared.
+// The map, palette and textures are loaded once for every client,
+// so each one only costs its screen's arena. frame holds the frame being sent,
+// sent bytes of it are out already, and no other frame is composed until it all is.
+typedef struct {
+	int			fd;
+	int			events;		// Events the fd is registered for in epoll
+	t_screen	scr;
+	t_player	player;
+	t_input		input;
+	size_t		sent;
+	long long	last_step;
+	long long	next_frame;
+	int			dirty;
+} t_client;
+
+// Server state : the listening socket, epoll, and the clients connected.
+typedef struct {
+	int			fd;
+	int			epoll;
+	t_client	*clients[SERVE_MAX_CLIENTS];
+	int			count;
+} t_server;
+
+t_server	server = { .fd = -1, .epoll = -1 };
+
+// Opens a stream socket to addr : TCP when addr is [HOST]:PORT, a Unix socket at that path
+// otherwise. Listening on it for the server, where a stale socket left at the path by
+// a previous one is removed first, connected to it for clients. Returns the fd, -1 on error.
+int socket_open(const char *addr, int listening)
+{
+	struct sockaddr_un	un;
+	struct addrinfo		hints;
+	struct addrinfo		*ai;
+	struct stat			st;
+	char				host[256];
+	const char			*port;
+	int					fd;
+	int					one;
+
+	fd = -1;
+	port = strrchr(addr, ':');
+	if (port && port[1] && port[1 + strspn(port + 1, "0123456789")] == '\0'
+		&& port - addr < (long)sizeof(host))
+	{
+		memcpy(host, addr, port - addr);
+		host[port - addr] = '\0';
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = listening ? AI_PASSIVE : 0;
+		if (getaddrinfo(*host ? host : NULL, port + 1, &hints, &ai) != 0)
+			return (fprintf(stderr, "%s: unknown address\n", addr), -1);
+		one = 1;
+		fd = socket(ai->ai_family, SOCK_STREAM, 0);
+		if (fd >= 0)
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (fd >= 0 && (listening ? bind(fd, ai->ai_addr, ai->ai_addrlen)
+			: connect(fd, ai->ai_addr, ai->ai_addrlen)) < 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(ai);
+	}
+	else
+	{
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		strncpy(un.sun_path, addr, sizeof(un.sun_path) - 1);
+		if (listening && stat(addr, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(addr);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd >= 0 && (listening ? bind(fd, (struct sockaddr *)&un, sizeof(un))
+			: connect(fd, (struct sockaddr *)&un, sizeof(un))) < 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd < 0 || (listening && listen(fd, SERVE_MAX_CLIENTS) < 0))
+	{
+		perror(addr);
+		if (fd >= 0)
+			close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+// Registers the client's fd in epoll for events, if that changes anything.
+void client_watch(t_client *c, int events)
+{
+	struct epoll_event	ev;
+
+	if (c->events == events)
+		return ;
+	ev.events = events;
+	ev.data.ptr = c;
+	epoll_ctl(server.epoll, c->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev);
+	c->events = events;
+}
+
+// Sends as much of the client's frame as the socket takes without blocking.
+// What's left is sent once epoll says the socket has room again.
+// A client that can't be written to anymore is marked to be dropped.
+void client_flush(t_client *c)
+{
+	ssize_t	n;
+
+	while (c->sent < c->scr.frame.len)
+	{
+		n = send(c->fd, c->scr.frame.data + c->sent, c->scr.frame.len - c->sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue ;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break ;
+		if (n <= 0)
+		{
+			c->input.quit = 1;
+			break ;
+		}
+		c->sent += n;
+	}
+	if (c->sent < c->scr.frame.len && !c->input.quit)
+	{
+		client_watch(c, EPOLLIN | EPOLLOUT);
+		return ;
+	}
+	c->scr.frame.len = 0;
+	c->sent = 0;
+	client_watch(c, EPOLLIN);
+}
+
+// Makes every client's player a sprite for the others, and has them all rendered again
+// with it. Called whenever a player moves, comes or goes.
+void serve_peers(void)
+{
+	t_client	*c;
+	int			i;
+
+	i = 0;
+	while (i < server.count)
+	{
+		c = server.clients[i];
+		sprites.peers[i++] = (t_sprite){ c->player.x, c->player.y, SPRITE_PEER, &c->scr };
+		c->dirty = 1;
+	}
+	sprites.peer_count = server.count;
+}
+
+// Uses the door in front of client c's player when space was pressed, for every client.
+void serve_use(t_client *c)
+{
+	int	x, y;
+	int	i;
+
+	if (!c->input.use)
+		return ;
+	c->input.use = 0;
+	if (!door_use(&c->player, &x, &y))
+		return ;
+	i = 0;
+	while (i < server.count)
+	{
+		screen_map_changed(&server.clients[i]->scr, x, y);
+		server.clients[i++]->dirty = 1;
+	}
+}
+
+// Accepts every pending connection, each with a player at the spawn point
+// and a screen at --size (or the default resolution, sockets have no window size).
+void serve_accept(void)
+{
+	t_client	*c;
+	int			fd;
+	int			one;
+
+	while ((fd = accept(server.fd, NULL, NULL)) >= 0)
+	{
+		c = server.count < SERVE_MAX_CLIENTS ? calloc(1, sizeof(*c)) : NULL;
+		if (!c)
+		{
+			close(fd);
+			continue ;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		c->fd = fd;
+		c->player.x = map.spawnX;
+		c->player.y = map.spawnY;
+		c->player.dirY = -1;
+		c->player.planeX = 0.66;
+		screen_resize(&c->scr, opts.width ? opts.width : DEFAULT_WIDTH,
+			opts.height ? opts.height : DEFAULT_HEIGHT, sizeof(PIXEL_CHAR) - 1);
+		c->last_step = now_ms();
+		c->next_frame = c->last_step;
+		c->dirty = 1;
+		if (!opts.binary)
+			frame_append(&c->scr.frame, HIDE_CURSOR, sizeof(HIDE_CURSOR) - 1);
+		client_flush(c);
+		server.clients[server.count++] = c;
+		serve_peers();
+	}
+}
+
+// Disconnects client i, after a best effort to leave its terminal usable.
+// Binary clients are --connect, which restores its own terminal when the stream ends.
+void serve_drop(int i)
+{
+	t_client	*c;
+
+	c = server.clients[i];
+	if (!opts.binary)
+		send(c->fd, RESET SHOW_CURSOR "\n", sizeof(RESET SHOW_CURSOR "\n") - 1, MSG_NOSIGNAL);
+	close(c->fd);
+	free(c->scr.arena);
+	free(c);
+	server.clients[i] = server.clients[--server.count];
+	serve_peers();
+}
+
+// Casts and composes a frame for a client. The workers are shared by every client,
+// so unlike render() casting isn't pipelined : they are waited for, like in the benchmark.
+void serve_render(t_client *c)
+{
+	t_columns	*cols;
+
+	cols = &c->scr.columns[0];
+	cast_begin(&c->scr, cols, &c->player);
+	if (pool.count)
+	{
+		pool_dispatch(&c->player, cols);
+		pool_wait();
+	}
+	else
+	{
+		STAT(cols->cast_ns = -now_ns());
+		cast_columns(&c->player, cols, 0, c->scr.width);
+		STAT(cols->cast_ns += now_ns());
+	}
+	fill_cells(&c->scr, cols);
+	compose(&c->scr);
+#ifdef STATS
+	cols->frame_ns = stats.frame_ns;
+	stats_frame(&c->scr, cols);
+#endif
+	c->scr.cur = !c->scr.cur;
+}
+
+// Server mode : one process renders a view for every client of the socket at addr.
+// Like the terminal event loop, it sleeps in epoll until a key arrives, a socket has room,
+// or the next frame of a client with something to render is due. A client still sending
+// its last frame doesn't get a new one, it gets whatever is current once it caught up,
+// so slow clients cost neither memory nor the time of the others.
+int serve_run(const char *addr)
+{
+	struct epoll_event	events[SERVE_EVENTS];
+	struct epoll_event	ev;
+	t_client			*c;
+	long long			now;
+	float				x, y;
+	int					timeout;
+	int					n;
+	int					i;
+
+	server.epoll = epoll_create1(0);
+	if (server.epoll < 0 || (server.fd = socket_open(addr, 1)) < 0)
+		return (-1);
+	fcntl(server.fd, F_SETFL, fcntl(server.fd, F_GETFL) | O_NONBLOCK);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(server.epoll, EPOLL_CTL_ADD, server.fd, &ev);
+	fprintf(stderr, "serving on %s\n", addr);
+	while (1)
+	{
+		timeout = -1;
+		now = now_ms();
+		i = 0;
+		while (i < server.count)
+		{
+			c = server.clients[i++];
+			if (!c->scr.frame.len && (c->dirty || input_active(&c->input, c->last_step)))
+			{
+				n = c->next_frame > now ? c->next_frame - now : 0;
+				timeout = timeout < 0 || n < timeout ? n : timeout;
+			}
+		}
+		n = epoll_wait(server.epoll, events, SERVE_EVENTS, timeout);
+		if (n < 0 && errno != EINTR)
+			return (perror("epoll_wait()"), -1);
+		i = 0;
+		while (i < n)
+		{
+			c = events[i].data.ptr;
+			if (!c)
+				serve_accept();
+			else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				c->dirty |= input_drain(&c->input, c->fd) > 0;
+			if (c && (events[i].events & EPOLLOUT))
+				client_flush(c);
+			i++;
+		}
+		now = now_ms();
+		i = 0;
+		while (i < server.count)
+		{
+			c = server.clients[i];
+			if (c->input.quit)
+			{
+				serve_drop(i);
+				continue ;
+			}
+			if (!c->scr.frame.len && (c->dirty || input_active(&c->input, c->last_step))
+				&& now >= c->next_frame)
+			{
+				input_frame(&c->input, c->last_step, now);
+				x = c->player.x;
+				y = c->player.y;
+				move_player(&c->player, &c->input);
+				if (x != c->player.x || y != c->player.y)
+					serve_peers();
+				serve_use(c);
+				STAT(stats.started = now_ns());
+				serve_render(c);
+				STAT(stats.frame_ns = now_ns() - stats.started);
+				c->dirty = 0;
+				c->last_step = now;
+				c->next_frame = now + 1000 / opts.fps;
+				client_flush(c);
+			}
+			i++;
+		}
+	}
+}
+
+// Messages received by --connect, buffered until they are complete.
+typedef struct {
+	unsigned char	*data;
+	size_t			len;
+	size_t			size;
+	char			glyphs[256][WIRE_GLYPH_MAX];
+} t_wire;
+
+t_wire	wire;
+
+// Reads the n byte little-endian integer at p.
+unsigned long long wire_get(const unsigned char *p, int n)
+{
+	unsigned long long	v;
+
+	v = 0;
+	while (n--)
+		v = v << 8 | p[n];
+	return (v);
+}
+
+// Reads the LEB128 varint at *p, not past end. Returns -1 if it is cut.
+long long wire_get_varint(const unsigned char **p, const unsigned char *end)
+{
+	unsigned long long	v;
+	int					shift;
+
+	v = 0;
+	shift = 0;
+	while (*p < end && shift < 63)
+	{
+		v |= (unsigned long long)(**p & 0x7f) << shift;
+		shift += 7;
+		if (!(*(*p)++ & 0x80))
+			return (v);
+	}
+	return (-1);
+}
+
+// Sets up the palette from a WIRE_PALETTE payload, encoded for this terminal.
+// Returns -1 if it is malformed.
+int wire_read_palette(const unsigned char *p, const unsigned char *end)
+{
+	t_color	*c;
+	int		count;
+	int		i;
+	int		n;
+
+	if (end - p < 2 || (count = wire_get(p, 2)) > 256)
+		return (-1);
+	p += 2;
+	i = 0;
+	while (i < count)
+	{
+		if (end - p < 4 || (n = p[3]) >= WIRE_GLYPH_MAX || end - p < 4 + (n ? 3 + n : 0))
+			return (-1);
+		c = &palette[i];
+		c->glyph = NULL;
+		if (n)
+		{
+			palette_set(i, p[4], p[5], p[6]);
+			c->len = color_escape(c->seq, sizeof(c->seq), 0, p[0], p[1], p[2]);
+			memcpy(wire.glyphs[i], p + 7, n);
+			c->glyph = wire.glyphs[i];
+			c->glyph_len = n;
+		}
+		else
+			palette_set(i, p[0], p[1], p[2]);
+		p += 4 + (n ? 3 + n : 0);
+		i++;
+	}
+	return (0);
+}
+
+// Applies a WIRE_FRAME payload to the screen, resized to the server's, and writes it out
+// as ANSI, a full repaint or a delta like any other frame. Returns -1 if it is malformed.
+int wire_read_frame(const unsigned char *p, const unsigned char *end)
+{
+	unsigned char	*cells;
+	long long		skip;
+	long long		len;
+	long long		i;
+	long long		n;
+	int				w;
+	int				h;
+
+	if (end - p < 6)
+		return (-1);
+	w = wire_get(p + 1, 2);
+	h = wire_get(p + 3, 2);
+	if (w < 1 || w > MAX_WIDTH || h < 1 || h > MAX_HEIGHT || p[5] < 1
+		|| p[5] > GOV_MAX_SCALE * (sizeof(PIXEL_CHAR) - 1))
+		return (-1);
+	opts.half_block = (p[0] & WIRE_HALF) != 0;
+	screen_resize(&screen, w, h, p[5]);
+	if (p[0] & WIRE_FULL)
+		screen.valid = 0;
+	cells = screen.cells[screen.cur];
+	n = (long long)w * h;
+	memcpy(cells, screen.cells[!screen.cur], n);
+	p += 6;
+	i = 0;
+	while (p < end)
+	{
+		skip = wire_get_varint(&p, end);
+		len = wire_get_varint(&p, end);
+		if (skip < 0 || len < 0 || p >= end || i + skip + len > n)
+			return (-1);
+		i += skip;
+		memset(cells + i, *p++, len);
+		i += len;
+	}
+	compose(&screen);
+	frame_flush(&screen.frame, STDOUT_FILENO);
+	screen.cur = !screen.cur;
+	return (0);
+}
+
+// Writes a WIRE_HUD line below the frame.
+void wire_read_hud(const unsigned char *p, const unsigned char *end)
+{
+	size_t	len;
+
+	len = end - p < HUD_MAX - CURSOR_ESC_MAX - 8 ? end - p : HUD_MAX - CURSOR_ESC_MAX - 8;
+	frame_append_cursor(&screen.frame, screen.rows, 0);
+	frame_append(&screen.frame, RESET, sizeof(RESET) - 1);
+	frame_append(&screen.frame, (const char *)p, len);
+	frame_append(&screen.frame, "\033[K", 3);
+	frame_flush(&screen.frame, STDOUT_FILENO);
+}
+
+// Handles every complete message received, keeping a partial one for later.
+// Returns -1 on a malformed message.
+int wire_read(void)
+{
+	const unsigned char	*p;
+	size_t				done;
+	size_t				len;
+	int					r;
+
+	done = 0;
+	while (wire.len - done >= WIRE_HEADER)
+	{
+		p = wire.data + done;
+		len = wire_get(p + 1, 4);
+		if (len > WIRE_MSG_MAX)
+			return (-1);
+		if (wire.len - done < WIRE_HEADER + len)
+			break ;
+		r = 0;
+		if (p[0] == WIRE_PALETTE)
+			r = wire_read_palette(p + WIRE_HEADER, p + WIRE_HEADER + len);
+		else if (p[0] == WIRE_FRAME)
+			r = wire_read_frame(p + WIRE_HEADER, p + WIRE_HEADER + len);
+		else if (p[0] == WIRE_HUD && screen.arena)
+			wire_read_hud(p + WIRE_HEADER, p + WIRE_HEADER + len);
+		if (r < 0)
+			return (-1);
+		done += WIRE_HEADER + len;
+	}
+	memmove(wire.data, wire.data + done, wire.len - done);
+	wire.len -= done;
+	return (0);
+}
+
+// Client mode : shows the frames of a --serve --binary server, decoded to ANSI for this
+// terminal with its own color support, and sends it the keys typed.
+// Quitting (ESC) is up to the server, which then hangs up.
+int connect_run(const char *addr)
+{
+	struct pollfd	pfd[2];
+	char			keys[256];
+	ssize_t			n;
+	int				fd;
+
+	fd = socket_open(addr, 0);
+	if (fd < 0)
+		return (-1);
+	terminal_raw();
+	pfd[0].fd = STDIN_FILENO;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = fd;
+	pfd[1].events = POLLIN;
+	while (poll(pfd, 2, -1) >= 0 || errno == EINTR)
+	{
+		if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			n = read(STDIN_FILENO, keys, sizeof(keys));
+			if (n <= 0 || send(fd, keys, n, MSG_NOSIGNAL) < 0)
+				break ;
+		}
+		if (!(pfd[1].revents & (POLLIN | POLLHUP | POLLERR)))
+			continue ;
+		if (wire.size - wire.len < 65536)
+		{
+			wire.size = wire.size ? wire.size * 2 : 1 << 20;
+			wire.data = realloc(wire.data, wire.size);
+			if (!wire.data)
+				return (perror("connect_run()"), -1);
+		}
+		n = read(fd, wire.data + wire.len, wire.size - wire.len);
+		if (n <= 0)
+			break ;
+		wire.len += n;
+		if (wire_read() < 0)
+		{
+			terminal_restore();
+			return (fprintf(stderr, "%s: bad frame from the server\n", addr), -1);
+		}
+	}
+	terminal_restore();
+	close(fd);
+	return (0);
+}
+
+void print_tab(char **t)
+{
+	while(*t)
+		printf("%s\n",*t++);
+}
+
+void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [options]\n"
+		"  --map FILE     load a text, binary or prebuilt map instead of the default one\n"
+		"  --gen-map WxH  generate a random map of that size instead\n"
+		"  --save-map OUT write the map as a prebuilt map file, then exit\n"
+		"  --full-redraw  repaint the whole screen every frame instead of only changed cells\n"
+		"  --fps N        frame rate cap (default %d)\n"
+		"  --shades N     shade walls with a gradient of N levels (2 to %d)\n"
+		"  --colors C     color escapes : true, 256 or 16 (default from COLORTERM/TERM)\n"
+		"  --half-block   two pixels per character cell, for twice the vertical resolution\n"
+		"  --textures     draw brick textures on walls\n"
+		"  --floor        cast a tiled floor and ceiling\n"
+		"  --minimap      show the map around the player in the top left corner\n"
+		"  --governor     lower the resolution, then the frame rate, when the terminal lags\n"
+		"  --scalar       cast rays one at a time instead of in SIMD packets\n"
+		"  --no-skip      step rays cell by cell, without crossing empty blocks at once\n"
+		"  --no-cache     always run the DDA, without trying each column's last wall cell first\n"
+		"  --view-radius N  stop rays after N cells (128 by default on prebuilt maps)\n"
+		"  --turn-reuse   while turning, reuse the walls of last frame's closest columns (approximate)\n"
+		"  --threads N    cast columns on N worker threads, pipelined with output\n"
+		"  --output-thread write frames on their own thread, dropping them when the terminal lags\n"
+		"  --size WxH     render at a fixed resolution instead of filling the terminal\n"
+		"  --bench [N]    render N frames (default %d) headless along a camera path, print timings\n"
+		"  --bench-path K keys of the benchmark camera path, one per %d ms ('.' for none)\n"
+		"  --verify [N]   render N frames (default %d) of the camera path with every caster,\n"
+		"                 checking them against the reference one\n"
+		"  --save-ref OUT with --verify, save the reference caster's columns to OUT\n"
+		"  --check-ref FILE with --verify, check the reference caster's columns against FILE\n"
+		"  --record FILE  log every key to FILE\n"
+		"  --replay FILE  replay the keys logged in FILE, as fast as possible with --bench\n"
+		"  --hud          show frame stats below the frame\n"
+		"  --stats FILE   stream frame stats as JSON lines to FILE, a Unix socket, or - for stderr\n"
+		"  --serve ADDR   render for every client connecting to a Unix socket, or TCP [HOST]:PORT\n"
+		"  --binary       with --serve, send frames in a compact binary protocol instead of ANSI\n"
+		"  --connect ADDR show the binary frames of a --serve --binary server\n",
+		name, TARGET_FPS, SHADE_LEVELS_MAX, BENCH_FRAMES, BENCH_BEAT_MS, VERIFY_FRAMES);
+	exit(1);
+}
+
+// Parses the command line into opts.
+void parse_args(int argc, char **argv)
+{
+	int	i;
+
+	opts.fps = TARGET_FPS;
+	opts.shades = SHADE_LEVELS;
+	opts.colors = detect_colors();
+	opts.bench_path = BENCH_PATH;
+	i = 1;
+	while (i < argc)
+	{
+		if (strcmp(argv[i], "--full-redraw") == 0)
+			opts.full_redraw = 1;
+		else if (strcmp(argv[i], "--scalar") == 0)
+			opts.scalar = 1;
+		else if (strcmp(argv[i], "--no-skip") == 0)
+			opts.no_skip = 1;
+		else if (strcmp(argv[i], "--no-cache") == 0)
+			opts.no_cache = 1;
+		else if (strcmp(argv[i], "--view-radius") == 0 && i + 1 < argc)
+		{
+			opts.view_radius = atoi(argv[++i]);
+			if (opts.view_radius < 1 || opts.view_radius > 65536)
+				usage(argv[0]);
+		}
+		else if (strcmp(argv[i], "--turn-reuse") == 0)
+			opts.turn_reuse = 1;
+		else if (strcmp(argv[i], "--floor") == 0)
+			opts.floor = 1;
+		else if (strcmp(argv[i], "--minimap") == 0)
+			opts.minimap = 1;
+		else if (strcmp(argv[i], "--textures") == 0)
+			opts.textures = 1;
+		else if (strcmp(argv[i], "--half-block") == 0)
+			opts.half_block = 1;
+		else if (strcmp(argv[i], "--governor") == 0)
+			opts.governor = 1;
+		else if (strcmp(argv[i], "--hud") == 0)
+			opts.hud = 1;
+		else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+			opts.stats_path = argv[++i];
+		else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+			opts.serve = argv[++i];
+		else if (strcmp(argv[i], "--binary") == 0)
+			opts.binary = 1;
+		else if (strcmp(argv[i], "--output-thread") == 0)
+			opts.output_thread = 1;
+		else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc)
+			opts.connect = argv[++i];
+		else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+		{
+			if (sscanf(argv[++i], "%dx%d", &opts.width, &opts.height) != 2
+				|| opts.width < 1 || opts.width > MAX_WIDTH
+				|| opts.height < 1 || opts.height > MAX_HEIGHT)
+				usage(argv[0]);
+		}
+		else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+			opts.record_path = argv[++i];
+		else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+			opts.replay_path = argv[++i];
+		else if (strcmp(argv[i], "--map") == 0 && i + 1 < argc)
+			opts.map_path = argv[++i];
+		else if (strcmp(argv[i], "--save-map") == 0 && i + 1 < argc)
+			opts.save_path = argv[++i];
+		else if (strcmp(argv[i], "--gen-map") == 0 && i + 1 < argc)
+		{
+			if (sscanf(argv[++i], "%dx%d", &opts.gen_width, &opts.gen_height) != 2
+				|| opts.gen_width < 1 || opts.gen_height < 1)
+				usage(argv[0]);
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			opts.threads = atoi(argv[++i]);
+			if (opts.threads < 0)
+				usage(argv[0]);
+		}
+		else if (strcmp(argv[i], "--bench") == 0)
+		{
+			opts.bench = BENCH_FRAMES;
+			if (i + 1 < argc && argv[i + 1][0] != '-')
+				opts.bench = atoi(argv[++i]);
+			if (opts.bench <= 0)
+				usage(argv[0]);
+		}
+		else if (strcmp(argv[i], "--verify") == 0)
+		{
+			opts.verify = 1;
+			opts.bench = VERIFY_FRAMES;
+			if (i + 1 < argc && argv[i + 1][0] != '-')
+				opts.bench = atoi(argv[++i]);
+			if (opts.bench <= 0)
+				usage(argv[0]);
+		}
+		else if ((strcmp(argv[i], "--save-ref") == 0 || strcmp(argv[i], "--check-ref") == 0)
+			&& i + 1 < argc)
+		{
+			opts.ref_save = argv[i][2] == 's';
+			opts.ref_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "--bench-path") == 0 && i + 1 < argc)
+		{
+			opts.bench_path = argv[++i];
+			if (!*opts.bench_path)
+				usage(argv[0]);
+		}
+		else if (strcmp(argv[i], "--colors") == 0 && i + 1 < argc)
+		{
+			i++;
+			if (strcmp(argv[i], "true") == 0)
+				opts.colors = COLORS_TRUE;
+			else if (strcmp(argv[i], "256") == 0)
+				opts.colors = COLORS_256;
+			else if (strcmp(argv[i], "16") == 0)
+				opts.colors = COLORS_16;
+			else
+				usage(argv[0]);
+		}
+		else if (strcmp(argv[i], "--shades") == 0 && i + 1 < argc)
+		{
+			opts.shades = atoi(argv[++i]);
+			if (opts.shades < 2 || opts.shades > SHADE_LEVELS_MAX)
+				usage(argv[0]);
+		}
+		else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc)
+		{
+			opts.fps = atoi(argv[++i]);
+			if (opts.fps <= 0)
+				usage(argv[0]);
+		}
+		else
+			usage(argv[0]);
+		i++;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	t_player player;
+	t_input input;
+	int y;
+	int x;
+	int p;
+	int dirty;
+	int active;
+	int timeout;
+	long long now;
+	long long last_step;
+	long long next_frame;
+	long long frame_ms;
+	long long start;
+	struct pollfd pfd;
+
+	parse_args(argc, argv);
+	// Before --connect too : its colors come from the server, but its screen is set up
+	// from the shade tables like any other.
+	palette_build(opts.shades);
+	if (opts.connect)
+		return (connect_run(opts.connect) < 0);
+	if (opts.binary && !opts.serve)
+		return (fprintf(stderr, "%s: --binary only works with --serve\n", argv[0]), 1);
+#ifdef PACKET_DISPATCH
+	if (__builtin_cpu_supports("avx2"))
+		packet_lanes = 8;
+#endif
+	memset(&input, 0, sizeof(input));
+	if (opts.map_path)
+		x = map_load(opts.map_path);
+	else if (opts.gen_width)
+		x = map_generate(opts.gen_width, opts.gen_height, 1);
+	else
+		x = map_from_lines(default_map, "default map");
+	if (x < 0 || map_build_accel() < 0 || sprites_build() < 0)
+		return (1);
+	if (opts.save_path)
+		return (map_save(opts.save_path) < 0);
+	if (map.prebuilt && !opts.view_radius)
+		opts.view_radius = VIEW_RADIUS_MAPPED;
+#ifdef FIXED_DDA
+	if (opts.view_radius)
+		dda_limit = (t_dist)opts.view_radius << FIX_BITS;
+#else
+	if (opts.view_radius)
+		dda_limit = opts.view_radius;
+#endif
+	if (opts.minimap)
+		minimap_build();
+	player.x = map.spawnX;
+	player.y = map.spawnY;
+	player.dirX = 0;
+	player.dirY = -1;
+	player.planeX = 0.66;
+	player.planeY = 0;
+	if (opts.replay_path && replay_open(opts.replay_path) < 0)
+		return (1);
+#ifdef STATS
+	if (opts.stats_path && stats_open(opts.stats_path) < 0)
+		return (1);
+#else
+	if (opts.hud || opts.stats_path)
+		return (fprintf(stderr, "%s: built without stats (NO_STATS)\n", argv[0]), 1);
+#endif
+#ifdef FIXED_DDA
+	if (opts.turn_reuse)
+		return (fprintf(stderr, "%s: --turn-reuse is not available with FIXED_DDA\n", argv[0]), 1);
+	recip_build();
+#endif
+	if (opts.threads)
+		pool_start(opts.threads);
+	if (opts.ref_path && !opts.verify)
+		return (fprintf(stderr, "%s: --save-ref and --check-ref need --verify\n", argv[0]), 1);
+	if (opts.output_thread && opts.governor)
+		return (fprintf(stderr, "%s: --output-thread can't be combined with --governor\n", argv[0]), 1);
+	if (opts.serve && (opts.bench || opts.governor || opts.record_path || opts.replay_path))
+		return (fprintf(stderr, "%s: --serve can't be combined with --bench, --governor,"
+			" --record or --replay\n", argv[0]), 1);
+	governor.fps = opts.fps;
+	if (opts.serve)
+		return (serve_run(opts.serve) < 0);
+	// The benchmark renders at --size, or the default resolution, whatever the terminal.
+	x = opts.width ? opts.width : DEFAULT_WIDTH;
+	y = opts.height ? opts.height : DEFAULT_HEIGHT;
+	p = sizeof(PIXEL_CHAR) - 1;
+	if (!opts.bench)
+		query_size(&x, &y, &p);
+	screen_resize(&screen, x, y, p);
+	if (opts.verify)
+		return (verify_run(&screen, &reference, &player) != 0);
+	if (opts.bench)
+		return (bench_run(&screen, &reference, &player) < 0);
+	if (opts.record_path && record_open(opts.record_path, now_ms()) < 0)
+		return (1);
+	terminal_raw();
+	if (opts.output_thread && output_start(&screen) < 0)
+		return (perror("output_start()"), 1);
+	// Event loop : block on stdin until a key arrives, or until the next frame deadline
+	// when a change is waiting to be rendered or a key is held. An idle session sleeps in poll().
+	// Every frame drains all pending bytes first, then simulates the time elapsed
+	// since the previous frame once, with the keys held during that time.
+	// With --replay, recorded keys are fed at their original time on top of the terminal's.
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+	frame_ms = 1000 / governor.fps;
+	next_frame = now_ms();
+	last_step = next_frame;
+	start = next_frame;
+	dirty = 1;
+	while (!input.quit)
 	{
-		render(player);
-		if (kbhit())
+		active = dirty || input_active(&input, last_step);
+		timeout = -1;
+		if (active)
+			timeout = next_frame > now_ms() ? next_frame - now_ms() : 0;
+		if (replay.data && !replay.done && (!active || start + replay.at < next_frame))
+			timeout = start + replay.at > now_ms() ? start + replay.at - now_ms() : 0;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+			break ;
+		if (winched || governor.changed)
+		{
+			winched = 0;
+			governor.changed = 0;
+			frame_ms = 1000 / governor.fps;
+			query_size(&x, &y, &p);
+			dirty |= screen_resize(&screen, x, y, p);
+		}
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+			dirty |= input_drain(&input, STDIN_FILENO) > 0;
+		now = now_ms();
+		if (replay.data)
+			dirty |= replay_feed(&input, now - start, start) > 0;
+		if (!input.quit && (dirty || input_active(&input, last_step)) && now >= next_frame)
 		{
-			c = getch();
-			if (c == 27) break;
-			move_player(&player, c);
+			input_frame(&input, last_step, now);
+			move_player(&player, &input);
+			player_use(&screen, &player, &input);
+			STAT(stats.started = now_ns());
+			dirty = render(&screen, player);
+			STAT(stats.frame_ns = now_ns() - stats.started);
+			last_step = now;
+			next_frame = now + frame_ms;
 		}
-		usleep(15000);
 	}
+	output_stop();
+	terminal_restore();
 	return 0;
 }
+#endif